@@ -1,5 +1,4 @@
 #include "aabb.h"
-#include "geometry.h"
 
 AABB::AABB()
 {
@@ -17,38 +16,19 @@ AABB::AABB(QVector4D minPoint, QVector4D maxPoint)
     zmax = maxPoint.z();
 }
 
-AABB::~AABB()
-{
-
-}
-
 void AABB::transform(QMatrix4x4 matrix)
 {
-    QVector4D minPoint(xmin, ymin, zmin, 1.0f);
-    QVector4D maxPoint(xmax, ymax, zmax, 1.0f);
-    minPoint = matrix * minPoint;
-    maxPoint = matrix * maxPoint;
-    xmin = minPoint.x();
-    ymin = minPoint.y();
-    zmin = minPoint.z();
-    xmax = maxPoint.x();
-    ymax = maxPoint.y();
-    zmax = maxPoint.z();
-    if(xmin > xmax) {
-        float tmp = xmin;
-        xmin = xmax;
-        xmax = tmp;
-    }
-    if(ymin > ymax) {
-        float tmp = ymin;
-        ymin = ymax;
-        ymax = tmp;
-    }
-    if(zmin > zmax) {
-        float tmp = zmin;
-        zmin = zmax;
-        zmax = tmp;
+    // transform all eight corners, rotations can move any of them to the extremes
+    AABB result;
+    for(int i = 0; i < 8; i++){
+        QVector4D corner((i & 1) ? xmax : xmin,
+                         (i & 2) ? ymax : ymin,
+                         (i & 4) ? zmax : zmin,
+                         1.0f);
+        corner = matrix * corner;
+        result.merge(corner.x(), corner.y(), corner.z());
     }
+    *this = result;
 }
 
 bool AABB::pointInAABB(QVector3D p)
@@ -61,20 +41,33 @@ bool AABB::pointInAABB(QVector3D p)
         return false;
 }
 
-bool AABB::intersect(Intersection &intersection)
+void AABB::merge(const AABB &other)
+{
+    xmin = std::min(xmin, other.xmin);
+    ymin = std::min(ymin, other.ymin);
+    zmin = std::min(zmin, other.zmin);
+    xmax = std::max(xmax, other.xmax);
+    ymax = std::max(ymax, other.ymax);
+    zmax = std::max(zmax, other.zmax);
+}
+
+void AABB::merge(float x, float y, float z)
 {
-    Point p000(xmin, ymin, zmin);
-    Point p001(xmin, ymin, zmax);
-    Point p010(xmin, ymax, zmin);
-    Point p011(xmin, ymax, zmax);
-    Point p100(xmax, ymin, zmin);
-    Point p101(xmax, ymin, zmax);
-    Point p110(xmax, ymax, zmin);
-    Point p111(xmax, ymax, zmax);
-    return intersectRectangle(intersection.m_ray, p000, p001, p011, p010)
-        || intersectRectangle(intersection.m_ray, p100, p101, p111, p110)
-        || intersectRectangle(intersection.m_ray, p000, p010, p110, p100)
-        || intersectRectangle(intersection.m_ray, p001, p011, p111, p101)
-        || intersectRectangle(intersection.m_ray, p000, p001, p101, p100)
-        || intersectRectangle(intersection.m_ray, p010, p011, p111, p110);
+    xmin = std::min(xmin, x);
+    ymin = std::min(ymin, y);
+    zmin = std::min(zmin, z);
+    xmax = std::max(xmax, x);
+    ymax = std::max(ymax, y);
+    zmax = std::max(zmax, z);
 }
+
+float AABB::surfaceArea() const
+{
+    float dx = xmax - xmin;
+    float dy = ymax - ymin;
+    float dz = zmax - zmin;
+    if(dx < 0.0f || dy < 0.0f || dz < 0.0f)
+        return 0.0f;
+    return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
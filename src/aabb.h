@@ -3,24 +3,73 @@
 
 #include <QMatrix4x4>
 #include <QOpenGLFunctions_3_3_Core>
+#include "raytracing/basic.h"
 
-class Intersection;
+// The origin and reciprocal direction of a ray in SIMD registers, set up once
+// for the slab tests of all the boxes along a traversal
+struct RaySlabs
+{
+    Float4 origin;
+    Float4 invDirection;
+
+    explicit RaySlabs(const Ray& ray)
+        : origin(toFloat4(ray.m_origin)), invDirection(toFloat4(ray.m_invDirection)) { }
+};
 
 class AABB
 {
 public:
     AABB();
     AABB(QVector4D minPoint, QVector4D maxPoint);
-    ~AABB();
 
     void transform(QMatrix4x4 matrix);
     bool pointInAABB(QVector3D p);
-    bool intersect(Intersection& intersection);
+    // slab test of the ray against the box within [tMin, tMax]
+    bool intersect(const Ray& ray, float tMin, float tMax, float& tEnter, float& tExit) const;
+    bool intersect(const RaySlabs& ray, float tMin, float tMax, float& tEnter, float& tExit) const;
+
+    // helpers for building bounding volume hierarchies
+    void merge(const AABB& other);
+    void merge(float x, float y, float z);
+    float surfaceArea() const;
+    float lower(int axis) const { return axis == 0 ? xmin : (axis == 1 ? ymin : zmin); }
+    float upper(int axis) const { return axis == 0 ? xmax : (axis == 1 ? ymax : zmax); }
+    float center(int axis) const { return 0.5f * (lower(axis) + upper(axis)); }
 
 public:
-    float xmin, xmax;
-    float ymin, ymax;
-    float zmin, zmax;
+    // minimum corner then maximum corner, the slab test loads them as vectors
+    float xmin, ymin, zmin;
+    float xmax, ymax, zmax;
 };
 
+inline bool AABB::intersect(const Ray &ray, float tMin, float tMax, float &tEnter, float &tExit) const
+{
+    return intersect(RaySlabs(ray), tMin, tMax, tEnter, tExit);
+}
+
+inline bool AABB::intersect(const RaySlabs &ray, float tMin, float tMax, float &tEnter, float &tExit) const
+{
+    // xmin, ymin, zmin (and xmax in the unused lane); the maximum corner is
+    // loaded from zmin on so that nothing past the box is read
+    Float4 lower = Float4::load4(&xmin);
+    Float4 upper = Float4::load4(&zmin);
+#ifdef RAYTRACING_SSE
+    upper = _mm_shuffle_ps(upper.v, upper.v, _MM_SHUFFLE(0, 3, 2, 1));
+#else
+    upper = Float4(xmax, ymax, zmax, zmin);
+#endif
+    Float4 t0 = (lower - ray.origin) * ray.invDirection;
+    Float4 t1 = (upper - ray.origin) * ray.invDirection;
+    // a ray lying in a slab plane gives 0 * inf = NaN, that slab is ignored
+    Float4 inSlabPlane = unordered(t0, t1);
+    Float4 tNear = select(inSlabPlane, Float4(-kRayTMax), min(t0, t1));
+    Float4 tFar = select(inSlabPlane, Float4(kRayTMax), max(t0, t1));
+    tEnter = std::max(tMin, maxComponent3(tNear));
+    tExit = std::min(tMax, minComponent3(tFar));
+    return tEnter <= tExit;
+}
+
+// stored in flat buffers and copied byte for byte by the model cache
+static_assert(std::is_trivially_copyable<AABB>::value, "AABB must stay trivially copyable");
+
 #endif // AABB_H
@@ -0,0 +1,65 @@
+#include "assetregistry.h"
+
+#include <QFileInfo>
+#include <QMutex>
+#include <QWaitCondition>
+#include <map>
+#include <set>
+
+#include "objmodel.h"
+
+static QMutex s_registryMutex;
+static QWaitCondition s_assetLoaded;
+static std::map<std::string, std::weak_ptr<ObjModelAsset> > s_assets;
+// keys of the assets being loaded
+static std::set<std::string> s_loading;
+
+// the same file reached through different paths is one asset
+static std::string assetKey(const std::string& path, bool gamma)
+{
+    QString canonical = QFileInfo(QString::fromStdString(path)).canonicalFilePath();
+    std::string key = canonical.isEmpty() ? path : canonical.toStdString();
+    return key + (gamma ? "|gamma" : "|linear");
+}
+
+std::shared_ptr<ObjModelAsset> sharedObjModelAsset(const std::string &path, bool gamma)
+{
+    std::string key = assetKey(path, gamma);
+    {
+        QMutexLocker locker(&s_registryMutex);
+        while(true){
+            std::map<std::string, std::weak_ptr<ObjModelAsset> >::iterator it = s_assets.find(key);
+            if(it != s_assets.end()){
+                std::shared_ptr<ObjModelAsset> asset = it->second.lock();
+                if(asset)
+                    return asset;
+                s_assets.erase(it);
+            }
+            if(s_loading.count(key) == 0)
+                break;
+            s_assetLoaded.wait(&s_registryMutex);
+        }
+        s_loading.insert(key);
+    }
+
+    // loaded outside the lock, so other files load at the same time
+    std::shared_ptr<ObjModelAsset> asset = std::make_shared<ObjModelAsset>(path, gamma);
+
+    QMutexLocker locker(&s_registryMutex);
+    s_loading.erase(key);
+    s_assets[key] = asset;
+    s_assetLoaded.wakeAll();
+    return asset;
+}
+
+size_t sharedObjModelAssetCount()
+{
+    QMutexLocker locker(&s_registryMutex);
+    size_t count = 0;
+    std::map<std::string, std::weak_ptr<ObjModelAsset> >::const_iterator it;
+    for(it = s_assets.begin(); it != s_assets.end(); ++it){
+        if(!it->second.expired())
+            count++;
+    }
+    return count;
+}
@@ -0,0 +1,19 @@
+#ifndef ASSETREGISTRY_H
+#define ASSETREGISTRY_H
+
+#include <memory>
+#include <string>
+
+class ObjModelAsset;
+
+// Models placed from the same file share one ObjModelAsset: the registry
+// hands out the asset already loaded from a path while any model still
+// holds it, and loads it otherwise. An asset is freed with the last model
+// using it. Safe to call from several threads; a thread asking for an
+// asset that another one is loading waits for it instead of loading it
+// again.
+std::shared_ptr<ObjModelAsset> sharedObjModelAsset(const std::string& path, bool gamma);
+// number of assets currently alive in the registry
+size_t sharedObjModelAssetCount();
+
+#endif // ASSETREGISTRY_H
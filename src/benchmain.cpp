@@ -0,0 +1,601 @@
+// Benchmarks of the ray tracing core, written as JSON:
+//     rover-bench -o results.json
+// Microbenchmarks time single operations on random input, the build
+// benchmarks time the BVH builders and macrobenchmarks render full frames of
+// procedural scenes, both with 1, 2, 4, ... threads. The animation benchmark
+// times the top level BVH update of a crowd of moving models. The scenes are
+// made in code so that results do not depend on asset files.
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QThread>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <random>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "light.h"
+#include "locallighting.h"
+#include "objmodel.h"
+#include "raytracingscene.h"
+#include "scene.h"
+#include "tasksystem.h"
+#include "triangleblock.h"
+
+// rays, boxes and triangles the microbenchmarks cycle through
+const size_t kInputCount = 4096;
+
+static std::mt19937 rng(12345);
+
+static float randomFloat(float lo, float hi)
+{
+    return std::uniform_real_distribution<float>(lo, hi)(rng);
+}
+
+static Point randomPoint(float extent)
+{
+    return Point(randomFloat(-extent, extent), randomFloat(-extent, extent), randomFloat(-extent, extent));
+}
+
+static Vector randomDirection()
+{
+    Vector direction;
+    do {
+        direction = Vector(randomFloat(-1.0f, 1.0f), randomFloat(-1.0f, 1.0f), randomFloat(-1.0f, 1.0f));
+    } while (direction.length2() > 1.0f || direction.length2() < 1e-4f);
+    return direction.normalized();
+}
+
+// rays from a sphere around the origin aimed at points near it
+static std::vector<Ray> randomRays(size_t count, float extent)
+{
+    std::vector<Ray> rays;
+    for (size_t i = 0; i < count; ++i)
+    {
+        Point origin = Point(0.0f, 0.0f, 0.0f) + randomDirection() * (extent * 2.0f);
+        Point target = randomPoint(extent * 0.5f);
+        rays.push_back(Ray(origin, (target - origin).normalized()));
+    }
+    return rays;
+}
+
+static void addVertex(std::vector<Vertex>& vertices, AABB& bounds, const glm::vec3& position, const glm::vec3& normal)
+{
+    Vertex vertex;
+    vertex.Position = position;
+    vertex.Normal = normal;
+    vertex.TexCoords = glm::vec2(0.0f, 0.0f);
+    vertex.Tangent = glm::vec3(0.0f, 0.0f, 0.0f);
+    vertex.Bitangent = glm::vec3(0.0f, 0.0f, 0.0f);
+    vertices.push_back(vertex);
+    bounds.merge(position.x, position.y, position.z);
+}
+
+static void addTriangle(std::vector<unsigned int>& indices, std::vector<Face>& faces,
+                        unsigned int v0, unsigned int v1, unsigned int v2)
+{
+    Face face;
+    face.vertexIndices.push_back(v0);
+    face.vertexIndices.push_back(v1);
+    face.vertexIndices.push_back(v2);
+    indices.insert(indices.end(), face.vertexIndices.begin(), face.vertexIndices.end());
+    faces.push_back(face);
+}
+
+// UV sphere of radius 1 around the origin
+static Mesh makeSphere(unsigned int rings, unsigned int segments)
+{
+    std::vector<Vertex> vertices;
+    std::vector<unsigned int> indices;
+    std::vector<Face> faces;
+    AABB bounds;
+    for (unsigned int r = 0; r <= rings; ++r)
+    {
+        float theta = float(M_PI) * r / rings;
+        for (unsigned int s = 0; s <= segments; ++s)
+        {
+            float phi = 2.0f * float(M_PI) * s / segments;
+            glm::vec3 normal(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+            addVertex(vertices, bounds, normal, normal);
+        }
+    }
+    for (unsigned int r = 0; r < rings; ++r)
+    {
+        for (unsigned int s = 0; s < segments; ++s)
+        {
+            unsigned int v0 = r * (segments + 1) + s;
+            unsigned int v1 = v0 + segments + 1;
+            addTriangle(indices, faces, v0, v1, v0 + 1);
+            addTriangle(indices, faces, v0 + 1, v1, v1 + 1);
+        }
+    }
+    return Mesh(vertices, indices, faces, std::vector<Texture>(), bounds);
+}
+
+// square of side 2 in the xz plane, facing up
+static Mesh makePlane()
+{
+    std::vector<Vertex> vertices;
+    std::vector<unsigned int> indices;
+    std::vector<Face> faces;
+    AABB bounds;
+    glm::vec3 up(0.0f, 1.0f, 0.0f);
+    addVertex(vertices, bounds, glm::vec3(-1.0f, 0.0f, -1.0f), up);
+    addVertex(vertices, bounds, glm::vec3(1.0f, 0.0f, -1.0f), up);
+    addVertex(vertices, bounds, glm::vec3(1.0f, 0.0f, 1.0f), up);
+    addVertex(vertices, bounds, glm::vec3(-1.0f, 0.0f, 1.0f), up);
+    addTriangle(indices, faces, 0, 2, 1);
+    addTriangle(indices, faces, 0, 3, 2);
+    return Mesh(vertices, indices, faces, std::vector<Texture>(), bounds);
+}
+
+// small random triangles filling a cube of the given extent
+static Mesh makeTriangleSoup(size_t count, float extent, float size)
+{
+    std::vector<Vertex> vertices;
+    std::vector<unsigned int> indices;
+    std::vector<Face> faces;
+    AABB bounds;
+    for (size_t i = 0; i < count; ++i)
+    {
+        Point center = randomPoint(extent);
+        Vector normal = randomDirection();
+        glm::vec3 n(normal.m_x, normal.m_y, normal.m_z);
+        unsigned int first = static_cast<unsigned int>(vertices.size());
+        for (int k = 0; k < 3; ++k)
+        {
+            Point p = center + randomDirection() * size;
+            addVertex(vertices, bounds, glm::vec3(p.m_x, p.m_y, p.m_z), n);
+        }
+        addTriangle(indices, faces, first, first + 1, first + 2);
+    }
+    return Mesh(vertices, indices, faces, std::vector<Texture>(), bounds);
+}
+
+static std::shared_ptr<ObjModelAsset> makeAsset(const Mesh& mesh)
+{
+    return std::make_shared<ObjModelAsset>(std::vector<Mesh>(1, mesh));
+}
+
+static ObjModel* addModel(Scene& scene, const std::shared_ptr<ObjModelAsset>& asset, const QMatrix4x4& modelMatrix,
+                          float ka, float ks, float kt)
+{
+    ObjModel *model = new ObjModel(asset);
+    model->setModelMatrix(modelMatrix);
+    model->ka = QVector3D(ka, ka, ka);
+    model->ks = QVector3D(ks, ks, ks);
+    model->kt = QVector3D(kt, kt, kt);
+    model->n = 16;
+    scene.models.push_back(model);
+    return model;
+}
+
+static void addPointLight(Scene& scene, const Point& position)
+{
+    scene.lights.push_back(new PointLight(Color(0.5f, 0.5f, 0.5f), position));
+    scene.lightFlag.push_back(true);
+}
+
+struct BenchmarkScene
+{
+    QString name;
+    Scene scene;
+    PerspectiveCamera camera;
+    size_t triangleCount;
+};
+
+// a grid of reflective spheres on a floor, all instances of one sphere
+static void makeSpheresScene(BenchmarkScene& bench)
+{
+    bench.name = "spheres";
+    Mesh sphere = makeSphere(32, 64);
+    Mesh plane = makePlane();
+    QMatrix4x4 floor;
+    floor.translate(0.0f, -1.0f, 0.0f);
+    floor.scale(20.0f);
+    addModel(bench.scene, makeAsset(plane), floor, 0.1f, 0.3f, 0.0f);
+    bench.triangleCount = plane.faces.size();
+    std::shared_ptr<ObjModelAsset> sphereAsset = makeAsset(sphere);
+    for (int z = 0; z < 4; ++z)
+    {
+        for (int x = 0; x < 4; ++x)
+        {
+            QMatrix4x4 matrix;
+            matrix.translate(3.0f * x - 4.5f, 0.0f, -3.0f * z);
+            addModel(bench.scene, sphereAsset, matrix, 0.1f, 0.4f, 0.0f);
+            bench.triangleCount += sphere.faces.size();
+        }
+    }
+    addPointLight(bench.scene, Point(5.0f, 10.0f, 5.0f));
+    addPointLight(bench.scene, Point(-8.0f, 6.0f, 2.0f));
+    bench.camera = PerspectiveCamera(30.0f, Point(0.0f, 2.0f, 8.0f), Vector(0.0f, -0.2f, -1.0f),
+                                     Vector(0.0f, 1.0f, 0.0f), 0.1f, 0.5f);
+}
+
+// one large model of random triangles, stresses the mesh BVH
+static void makeSoupScene(BenchmarkScene& bench)
+{
+    bench.name = "soup";
+    Mesh soup = makeTriangleSoup(200000, 5.0f, 0.08f);
+    addModel(bench.scene, makeAsset(soup), QMatrix4x4(), 0.2f, 0.2f, 0.0f);
+    bench.triangleCount = soup.faces.size();
+    addPointLight(bench.scene, Point(0.0f, 20.0f, 10.0f));
+    bench.camera = PerspectiveCamera(30.0f, Point(0.0f, 0.0f, 16.0f), Vector(0.0f, 0.0f, -1.0f),
+                                     Vector(0.0f, 1.0f, 0.0f), 0.1f, 0.5f);
+}
+
+// Runs op(i) for i = 0, 1, ... until at least minTime ms have passed and
+// returns the time per call in ns. The results are summed into sink so that
+// the compiler cannot drop the work.
+template <typename Op>
+static QJsonObject microBenchmark(const QString& name, qint64 minTime, double& sink, Op op)
+{
+    QElapsedTimer timer;
+    timer.start();
+    size_t iterations = 0;
+    size_t batch = kInputCount;
+    while (timer.elapsed() < minTime)
+    {
+        for (size_t i = 0; i < batch; ++i)
+            sink += op(i % kInputCount);
+        iterations += batch;
+    }
+    double ns = double(timer.nsecsElapsed()) / iterations;
+    std::cerr << name.toStdString() << ": " << ns << " ns" << std::endl;
+
+    QJsonObject result;
+    result.insert("name", name);
+    result.insert("iterations", double(iterations));
+    result.insert("ns_per_op", ns);
+    return result;
+}
+
+static QJsonArray runMicroBenchmarks(qint64 minTime)
+{
+    double sink = 0.0;
+    QJsonArray results;
+
+    std::vector<Ray> rays = randomRays(kInputCount, 1.0f);
+    // full blocks of random triangles, the leaves the renderer tests rays against
+    std::vector<TriangleBlock> blocks(kInputCount);
+    for (size_t i = 0; i < kInputCount; ++i)
+        for (unsigned int lane = 0; lane < kTriangleBlockWidth; ++lane)
+            blocks[i].setTriangle(lane, randomPoint(1.0f), randomPoint(1.0f), randomPoint(1.0f), lane);
+    std::vector<AABB> boxes(kInputCount);
+    for (size_t i = 0; i < kInputCount; ++i)
+    {
+        Point a = randomPoint(1.0f), b = randomPoint(1.0f);
+        boxes[i].merge(a.m_x, a.m_y, a.m_z);
+        boxes[i].merge(b.m_x, b.m_y, b.m_z);
+    }
+
+    // every kernel this build and CPU have, the scalar one included
+    TriangleKernel defaultKernel = triangleKernel();
+    for (int kernel = ScalarKernel; kernel <= AVX2Kernel; ++kernel)
+    {
+        if (!setTriangleKernel(static_cast<TriangleKernel>(kernel)))
+            continue;
+        results.append(microBenchmark(QString("intersectTriangleBlocks (%1)").arg(triangleKernelName()),
+                                      minTime, sink, [&](size_t i){
+            TriangleHit hit;
+            return intersectTriangleBlocks(&blocks[i], 1, rays[i], kRayTMax, hit) ? double(hit.t) : 0.0;
+        }));
+        results.append(microBenchmark(QString("occludedTriangleBlocks (%1)").arg(triangleKernelName()),
+                                      minTime, sink, [&](size_t i){
+            return occludedTriangleBlocks(&blocks[i], 1, rays[i], kRayTMax) ? 1.0 : 0.0;
+        }));
+    }
+    setTriangleKernel(defaultKernel);
+
+    results.append(microBenchmark("AABB::intersect", minTime, sink, [&](size_t i){
+        float tEnter, tExit;
+        return boxes[i].intersect(rays[i], 0.0f, kRayTMax, tEnter, tExit) ? 1.0 : 0.0;
+    }));
+
+    // a 10k triangle soup, half of the rays miss, traversed as the binary
+    // tree and as the wide one
+    Mesh mesh = makeTriangleSoup(10000, 1.0f, 0.05f);
+    BVHLayout defaultLayout = bvhLayout();
+    for (int layout = BinaryBVH; layout <= WideBVH; ++layout)
+    {
+        setBVHLayout(static_cast<BVHLayout>(layout));
+        mesh.buildBVH();
+        results.append(microBenchmark(QString("Mesh::intersect (%1)").arg(bvhLayoutName(bvhLayout())),
+                                      minTime, sink, [&](size_t i){
+            // counted the way a scene query counts
+            Intersection intersection;
+            TraversalCounts counts;
+            bool hit = mesh.intersect(rays[i], intersection, counts);
+            countTraversal(counts);
+            return hit ? double(intersection.m_t) : 0.0;
+        }));
+    }
+    setBVHLayout(defaultLayout);
+
+    QMatrix4x4 matrix;
+    matrix.rotate(30.0f, 1.0f, 2.0f, 3.0f);
+    matrix.translate(1.0f, -2.0f, 3.0f);
+    matrix.scale(0.5f, 2.0f, 1.5f);
+    Matrix3x4 transform(matrix);
+    results.append(microBenchmark("Ray::transform", minTime, sink, [&](size_t i){
+        return double(rays[i].transform(transform).m_direction.m_x);
+    }));
+
+    // shading a hit lit by two lights, with one shadow ray each
+    BenchmarkScene bench;
+    makeSpheresScene(bench);
+    bench.scene.updateTopLevel();
+    std::vector<Point> hitPoints;
+    std::vector<Vector> normals;
+    std::vector<float> distances;
+    // as if seen through the camera of makeSpheresScene
+    const Point eye(0.0f, 2.0f, 8.0f);
+    for (size_t i = 0; i < kInputCount; ++i)
+    {
+        Vector normal = randomDirection();
+        normal.m_y = std::fabs(normal.m_y);
+        normals.push_back(normal);
+        hitPoints.push_back(Point(randomFloat(-6.0f, 6.0f), randomFloat(-1.0f, 1.0f), randomFloat(-10.0f, 1.0f)) + normal * 0.01f);
+        distances.push_back((hitPoints.back() - eye).length());
+    }
+    results.append(microBenchmark("PhongLighting", minTime, sink, [&](size_t i){
+        Color color = PhongLighting(hitPoints[i], normals[i], rays[i].m_direction, distances[i], bench.scene,
+                                    bench.scene.lightFlag, QVector3D(0.2f, 0.2f, 0.2f), QVector3D(0.4f, 0.4f, 0.4f), 16.0);
+        return double(color.m_r);
+    }));
+
+    // keeps sink alive
+    if (sink == -1.0)
+        std::cerr << sink << std::endl;
+    return results;
+}
+
+// Builds the BVH of a million triangle soup with every builder on 1, 2,
+// 4, ... threads, reporting the build times and the SAH cost of the trees
+static QJsonArray runBuildBenchmarks(int builds, const std::vector<int>& threadCounts)
+{
+    Mesh soup = makeTriangleSoup(1000000, 5.0f, 0.02f);
+    BVHBuilder defaultBuilder = bvhBuilder();
+    int defaultThreads = taskPool()->maxThreadCount();
+    QJsonArray results;
+    for (int builder = SAHBuilder; builder <= MortonBuilder; ++builder)
+    {
+        setBVHBuilder(static_cast<BVHBuilder>(builder));
+        QJsonObject result;
+        result.insert("builder", bvhBuilderName(bvhBuilder()));
+        result.insert("bvh", bvhLayoutName(bvhLayout()));
+        result.insert("triangles", double(soup.faces.size()));
+
+        QJsonArray runs;
+        for (size_t t = 0; t < threadCounts.size(); ++t)
+        {
+            taskPool()->setMaxThreadCount(threadCounts[t]);
+            std::vector<double> times;
+            for (int b = 0; b < builds; ++b)
+            {
+                soup.buildBVH();
+                times.push_back(soup.bvh.buildTime);
+            }
+            std::sort(times.begin(), times.end());
+            double median = times[times.size() / 2];
+            std::cerr << "build (" << bvhBuilderName(bvhBuilder()) << ") " << threadCounts[t]
+                      << " threads: " << median << " ms" << std::endl;
+
+            QJsonObject run;
+            run.insert("threads", threadCounts[t]);
+            run.insert("build_ms", median);
+            run.insert("build_ms_min", times.front());
+            run.insert("build_ms_max", times.back());
+            runs.append(run);
+        }
+        result.insert("runs", runs);
+        result.insert("nodes", double(soup.bvh.nodes.size()));
+        result.insert("sah_cost", soup.bvh.sahCost());
+        results.append(result);
+    }
+    setBVHBuilder(defaultBuilder);
+    taskPool()->setMaxThreadCount(defaultThreads);
+    return results;
+}
+
+// Moves every instance of a crowd of spheres a little each frame and times
+// bringing the top level BVH up to date, against rebuilding it from scratch
+static QJsonObject runAnimationBenchmark(int frames)
+{
+    const int gridSize = 32;
+    const int animationFrames = 100 * frames;
+    Scene scene;
+    std::shared_ptr<ObjModelAsset> sphere = makeAsset(makeSphere(8, 16));
+    std::vector<QVector3D> origins;
+    for (int z = 0; z < gridSize; ++z)
+    {
+        for (int x = 0; x < gridSize; ++x)
+        {
+            origins.push_back(QVector3D(3.0f * x, 0.0f, 3.0f * z));
+            QMatrix4x4 matrix;
+            matrix.translate(origins.back());
+            addModel(scene, sphere, matrix, 0.1f, 0.4f, 0.0f);
+        }
+    }
+    scene.updateTopLevel();
+
+    std::vector<double> times;
+    QElapsedTimer timer;
+    for (int f = 1; f <= animationFrames; ++f)
+    {
+        // every sphere circles its grid cell with its own phase
+        for (size_t i = 0; i < scene.models.size(); ++i)
+        {
+            float angle = 0.05f * f + 0.7f * i;
+            QMatrix4x4 matrix;
+            matrix.translate(origins[i] + QVector3D(std::cos(angle), 0.5f * std::sin(2.0f * angle), std::sin(angle)));
+            scene.models[i]->setModelMatrix(matrix);
+        }
+        timer.start();
+        scene.updateTopLevel();
+        times.push_back(timer.nsecsElapsed() * 1e-6);
+    }
+    std::sort(times.begin(), times.end());
+    double median = times[times.size() / 2];
+    float refitCost = scene.topLevel.sahCost();
+    std::vector<AABB> bounds(scene.models.size());
+    for (size_t i = 0; i < bounds.size(); ++i)
+    {
+        bounds[i] = scene.models[i]->aabb;
+        bounds[i].transform(scene.models[i]->modelMatrix());
+    }
+    BVH rebuilt;
+    rebuilt.build(bounds);
+    std::cerr << "top level update, " << scene.models.size() << " moving models: " << median
+              << " ms, full build " << rebuilt.buildTime << " ms" << std::endl;
+
+    QJsonObject result;
+    result.insert("bvh", bvhLayoutName(bvhLayout()));
+    result.insert("models", double(scene.models.size()));
+    result.insert("frames", animationFrames);
+    result.insert("update_ms", median);
+    result.insert("update_ms_min", times.front());
+    result.insert("update_ms_max", times.back());
+    result.insert("build_ms", rebuilt.buildTime);
+    result.insert("sah_cost", refitCost);
+    result.insert("build_sah_cost", rebuilt.sahCost());
+    return result;
+}
+
+static QJsonObject runMacroBenchmark(BenchmarkScene& bench, size_t width, size_t height,
+                                     int frames, const std::vector<int>& threadCounts)
+{
+    // one sample per pixel, so the number of primary rays is exact
+    RenderSettings settings;
+    settings.minSamples = 1;
+    settings.maxSamples = 1;
+    double primaryRays = double(width) * double(height);
+
+    QJsonObject result;
+    result.insert("scene", bench.name);
+    result.insert("bvh", bvhLayoutName(bvhLayout()));
+    result.insert("width", double(width));
+    result.insert("height", double(height));
+    result.insert("models", double(bench.scene.models.size()));
+    result.insert("triangles", double(bench.triangleCount));
+    result.insert("max_ray_depth", double(settings.maxRayDepth));
+    result.insert("samples_per_pixel", 1);
+
+    int defaultThreads = taskPool()->maxThreadCount();
+    QJsonArray runs;
+    for (size_t t = 0; t < threadCounts.size(); ++t)
+    {
+        taskPool()->setMaxThreadCount(threadCounts[t]);
+        // warm up the pool and the caches, the work done is the same for every thread count
+        RenderStats stats = RenderStats();
+        delete renderRayTracing(bench.scene, bench.camera, width, height, settings,
+                                TileCallback(), nullptr, &stats);
+        if (t == 0)
+            result.insert("work_per_frame", stats.toJson());
+        std::vector<double> times;
+        for (int f = 0; f < frames; ++f)
+        {
+            QElapsedTimer timer;
+            timer.start();
+            delete renderRayTracing(bench.scene, bench.camera, width, height, settings);
+            times.push_back(timer.nsecsElapsed() / 1.0e6);
+        }
+        std::sort(times.begin(), times.end());
+        double median = times[times.size() / 2];
+        std::cerr << bench.name.toStdString() << " (" << bvhLayoutName(bvhLayout()) << ") "
+                  << threadCounts[t] << " threads: "
+                  << median << " ms/frame" << std::endl;
+
+        QJsonObject run;
+        run.insert("threads", threadCounts[t]);
+        run.insert("ms_per_frame", median);
+        run.insert("ms_per_frame_min", times.front());
+        run.insert("ms_per_frame_max", times.back());
+        run.insert("primary_rays_per_second", primaryRays / (median / 1000.0));
+        runs.append(run);
+    }
+    taskPool()->setMaxThreadCount(defaultThreads);
+    result.insert("runs", runs);
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QCoreApplication::setApplicationName("rover-bench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Benchmarks the ray tracing core and writes the results as JSON.");
+    parser.addHelpOption();
+    QCommandLineOption outputOption("o", "Output file, standard output if not set.", "file");
+    QCommandLineOption widthOption("width", "Frame width of the macrobenchmarks.", "pixels", "640");
+    QCommandLineOption heightOption("height", "Frame height of the macrobenchmarks.", "pixels", "480");
+    QCommandLineOption framesOption("frames", "Timed frames (and BVH builds) per scene and thread count.", "n", "5");
+    QCommandLineOption microTimeOption("micro-time", "Time per microbenchmark.", "ms", "500");
+    parser.addOption(outputOption);
+    parser.addOption(widthOption);
+    parser.addOption(heightOption);
+    parser.addOption(framesOption);
+    parser.addOption(microTimeOption);
+    parser.process(a);
+
+    size_t width = static_cast<size_t>(std::max(parser.value(widthOption).toInt(), 1));
+    size_t height = static_cast<size_t>(std::max(parser.value(heightOption).toInt(), 1));
+    int frames = std::max(parser.value(framesOption).toInt(), 1);
+    qint64 microTime = std::max(parser.value(microTimeOption).toInt(), 1);
+
+    // 1, 2, 4, ... up to all cores
+    int cores = std::max(QThread::idealThreadCount(), 1);
+    std::vector<int> threadCounts;
+    for (int t = 1; t < cores; t *= 2)
+        threadCounts.push_back(t);
+    threadCounts.push_back(cores);
+
+    QJsonObject machine;
+    machine.insert("ideal_thread_count", cores);
+    machine.insert("triangle_kernel", QString(triangleKernelName()));
+
+    QJsonObject root;
+    root.insert("machine", machine);
+    // single threaded, like the rest of a render's inner loop
+    root.insert("micro", runMicroBenchmarks(microTime));
+    root.insert("build", runBuildBenchmarks(frames, threadCounts));
+    root.insert("animation", runAnimationBenchmark(frames));
+
+    // every scene is built and rendered with the binary and the wide BVH
+    QJsonArray macro;
+    for (int layout = BinaryBVH; layout <= WideBVH; ++layout)
+    {
+        setBVHLayout(static_cast<BVHLayout>(layout));
+        // the same random triangles for both
+        rng.seed(54321);
+        BenchmarkScene spheres;
+        makeSpheresScene(spheres);
+        macro.append(runMacroBenchmark(spheres, width, height, frames, threadCounts));
+        BenchmarkScene soup;
+        makeSoupScene(soup);
+        macro.append(runMacroBenchmark(soup, width, height, frames, threadCounts));
+    }
+    root.insert("macro", macro);
+
+    QByteArray json = QJsonDocument(root).toJson(QJsonDocument::Indented);
+    if (parser.isSet(outputOption))
+    {
+        QFile file(parser.value(outputOption));
+        if (!file.open(QIODevice::WriteOnly))
+        {
+            std::cerr << "could not write " << parser.value(outputOption).toStdString() << std::endl;
+            return 1;
+        }
+        file.write(json);
+    }
+    else
+        std::cout << json.constData();
+    return 0;
+}
@@ -0,0 +1,57 @@
+#-------------------------------------------------
+#
+# Benchmarks of the ray tracing core, results are written as JSON:
+#     rover-bench -o results.json
+#
+#-------------------------------------------------
+
+# gui is only needed for the math types, no widgets
+QT       += core gui
+QT       -= widgets
+
+TARGET = rover-bench
+TEMPLATE = app
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+SOURCES += \
+    benchmain.cpp \
+    raytracingscene.cpp \
+    scene.cpp \
+    aabb.cpp \
+    bvh.cpp \
+    locallighting.cpp \
+    triangleblock.cpp \
+    tilescheduler.cpp \
+    tasksystem.cpp \
+    modelcache.cpp \
+    assetregistry.cpp
+
+HEADERS += \
+    stb_image.h \
+    mesh.h \
+    aabb.h \
+    bvh.h \
+    raytracingscene.h \
+    objmodel.h \
+    model.h \
+    scene.h \
+    raytracing/basic.h \
+    raytracing/simd.h \
+    light.h \
+    locallighting.h \
+    triangleblock.h \
+    tilescheduler.h \
+    tasksystem.h \
+    renderstats.h \
+    modelcache.h \
+    assetregistry.h
+
+INCLUDEPATH += C:\opengl\include \
+            C:\assimp-3.3.1\include \
+
+LIBS += C:\assimp-3.3.1\lib\libassimp.dll.a \
+        C:\assimp-3.3.1\lib\libzlibstatic.a
@@ -0,0 +1,596 @@
+#include "bvh.h"
+#include "tasksystem.h"
+
+#include <QElapsedTimer>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+
+// SAH cost model, relative to a single primitive test
+const float kTraversalCost = 1.0f;
+const float kIntersectionCost = 1.0f;
+const unsigned int kSAHBins = 16;
+const unsigned int kMaxLeafSize = 4;
+// below this depth nodes are split by the median instead of the SAH,
+// which keeps the tree within the traversal stack
+const unsigned int kMaxSAHDepth = 64;
+// nodes with at least this many primitives build their two subtrees in parallel
+const unsigned int kParallelSubtreeSize = 4096;
+// ranges of at least this many primitives are scanned in parallel, in
+// chunks of this size
+const unsigned int kParallelScanSize = 65536;
+const unsigned int kScanChunkSize = 16384;
+// bits per axis of the Morton codes
+const unsigned int kMortonBits = 10;
+
+#ifdef RAYTRACING_BINARY_BVH
+static std::atomic<int> s_bvhLayout(BinaryBVH);
+#else
+static std::atomic<int> s_bvhLayout(WideBVH);
+#endif
+
+void setBVHLayout(BVHLayout layout)
+{
+    s_bvhLayout = layout;
+}
+
+BVHLayout bvhLayout()
+{
+    return static_cast<BVHLayout>(s_bvhLayout.load());
+}
+
+const char* bvhLayoutName(BVHLayout layout)
+{
+    return layout == WideBVH ? "wide" : "binary";
+}
+
+static std::atomic<int> s_bvhBuilder(SAHBuilder);
+
+void setBVHBuilder(BVHBuilder builder)
+{
+    s_bvhBuilder = builder;
+}
+
+BVHBuilder bvhBuilder()
+{
+    return static_cast<BVHBuilder>(s_bvhBuilder.load());
+}
+
+const char* bvhBuilderName(BVHBuilder builder)
+{
+    return builder == MortonBuilder ? "morton" : "sah";
+}
+
+BVH4Node::BVH4Node()
+{
+    const float infinity = std::numeric_limits<float>::infinity();
+    for(int axis = 0; axis < 3; axis++){
+        for(int lane = 0; lane < 4; lane++){
+            bounds[0][axis][lane] = infinity;
+            bounds[1][axis][lane] = -infinity;
+        }
+    }
+    for(int lane = 0; lane < 4; lane++)
+        child[lane] = kEmptyChild;
+}
+
+void BVH4Node::setChild(unsigned int lane, const AABB &box, unsigned int ref)
+{
+    for(int axis = 0; axis < 3; axis++){
+        bounds[0][axis][lane] = box.lower(axis);
+        bounds[1][axis][lane] = box.upper(axis);
+    }
+    child[lane] = ref;
+}
+
+static unsigned int ceilDiv(unsigned int a, unsigned int b)
+{
+    return (a + b - 1) / b;
+}
+
+static float axisValue(const Vector& v, int axis)
+{
+    return axis == 0 ? v.m_x : (axis == 1 ? v.m_y : v.m_z);
+}
+
+// Runs body(first, last) over chunks of [0, count), on the pool when the
+// range is large and right away otherwise
+template<typename Body>
+static void scanChunks(unsigned int count, Body body)
+{
+    if(count < kParallelScanSize){
+        body(0u, count);
+        return;
+    }
+    parallelFor(ceilDiv(count, kScanChunkSize), [&](size_t c){
+        unsigned int first = static_cast<unsigned int>(c) * kScanChunkSize;
+        body(first, std::min(first + kScanChunkSize, count));
+    });
+}
+
+// Like scanChunks, every chunk collecting into its own Result with
+// body(first, last, result); the results are merged into result
+template<typename Result, typename Body>
+static void reduceChunks(unsigned int count, Result& result, Body body)
+{
+    if(count < kParallelScanSize){
+        body(0u, count, result);
+        return;
+    }
+    std::vector<Result> chunkResults(ceilDiv(count, kScanChunkSize));
+    scanChunks(count, [&](unsigned int first, unsigned int last){
+        body(first, last, chunkResults[first / kScanChunkSize]);
+    });
+    for(size_t c = 0; c < chunkResults.size(); c++)
+        result.merge(chunkResults[c]);
+}
+
+// spreads the low 10 bits of v out to every third bit
+static unsigned int expandBits(unsigned int v)
+{
+    v = (v * 0x00010001u) & 0xff0000ffu;
+    v = (v * 0x00000101u) & 0x0f00f00fu;
+    v = (v * 0x00000011u) & 0xc30c30c3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+static unsigned int highestBit(unsigned int v)
+{
+    unsigned int bit = 0;
+    while(v >>= 1)
+        bit++;
+    return bit;
+}
+
+struct BVH::BuildState
+{
+    const std::vector<AABB>& primBounds;
+    std::vector<Vector> centroids;
+    // Morton code of every entry of primIndices, MortonBuilder only
+    std::vector<unsigned int> mortonCodes;
+    unsigned int maxLeafSize;
+    // nodes handed out so far; nodes is sized for the largest possible tree
+    // before the build starts, so that the tasks can fill it without locking
+    std::atomic<unsigned int> nodeCount;
+
+    BuildState(const std::vector<AABB>& primBounds, unsigned int maxLeafSize)
+        : primBounds(primBounds), maxLeafSize(maxLeafSize), nodeCount(1) { }
+
+    // index of two new sibling nodes
+    unsigned int allocatePair() { return nodeCount.fetch_add(2); }
+};
+
+// bounds of a range of primitives and of their centroids
+struct RangeBounds
+{
+    AABB bounds;
+    AABB centroidBounds;
+
+    void merge(const RangeBounds& other)
+    {
+        bounds.merge(other.bounds);
+        centroidBounds.merge(other.centroidBounds);
+    }
+};
+
+// primitive counts and bounds of the SAH bins
+struct SAHBins
+{
+    AABB bounds[kSAHBins];
+    unsigned int count[kSAHBins];
+
+    SAHBins() { std::fill(count, count + kSAHBins, 0u); }
+
+    void merge(const SAHBins& other)
+    {
+        for(unsigned int b = 0; b < kSAHBins; b++){
+            bounds[b].merge(other.bounds[b]);
+            count[b] += other.count[b];
+        }
+    }
+};
+
+void BVH::build(const std::vector<AABB> &primBounds, unsigned int leafBlockSize)
+{
+    QElapsedTimer timer;
+    timer.start();
+    this->leafBlockSize = std::max(leafBlockSize, 1u);
+    nodes.clear();
+    primIndices.clear();
+    wideNodes.clear();
+    buildTime = 0.0;
+    unsigned int primNum = static_cast<unsigned int>(primBounds.size());
+    if(primNum == 0)
+        return;
+
+    BuildState state(primBounds, std::max(kMaxLeafSize, this->leafBlockSize));
+    state.centroids.resize(primNum);
+    primIndices.resize(primNum);
+    AABB centroidBounds;
+    reduceChunks(primNum, centroidBounds, [&](unsigned int first, unsigned int last, AABB& chunkCentroidBounds){
+        for(unsigned int i = first; i < last; i++){
+            const AABB& b = primBounds[i];
+            state.centroids[i] = Vector(b.center(0), b.center(1), b.center(2));
+            chunkCentroidBounds.merge(b.center(0), b.center(1), b.center(2));
+            primIndices[i] = i;
+        }
+    });
+
+    // a binary tree with at least one primitive per leaf has at most 2n - 1 nodes
+    nodes.resize(2 * primNum - 1);
+    nodes[0].start = 0;
+    nodes[0].count = primNum;
+    if(bvhBuilder() == MortonBuilder){
+        sortMorton(state, centroidBounds);
+        buildMorton(state, 0, 0, primNum);
+    }
+    else
+        subdivide(state, 0, 0);
+    nodes.resize(state.nodeCount);
+    nodes.shrink_to_fit();
+
+    if(bvhLayout() == WideBVH && !nodes[0].isLeaf()){
+        // every wide node takes the place of at least three binary ones
+        wideNodes.reserve(nodes.size() / 3 + 1);
+        collapse(0);
+    }
+    buildTime = timer.nsecsElapsed() * 1e-6;
+}
+
+float BVH::sahCost() const
+{
+    if(nodes.empty())
+        return 0.0f;
+    double cost = 0.0;
+    for(size_t n = 0; n < nodes.size(); n++){
+        const BVHNode& node = nodes[n];
+        float nodeCost = node.isLeaf() ? kIntersectionCost * ceilDiv(node.count, leafBlockSize) : kTraversalCost;
+        cost += nodeCost * node.bounds.surfaceArea();
+    }
+    float rootArea = nodes[0].bounds.surfaceArea();
+    return rootArea > 0.0f ? static_cast<float>(cost / rootArea) : 0.0f;
+}
+
+// union of the boxes of the used lanes
+static AABB wideNodeBounds(const BVH4Node& node)
+{
+    AABB bounds;
+    for(int lane = 0; lane < 4; lane++){
+        if(node.child[lane] == kEmptyChild)
+            continue;
+        bounds.merge(node.bounds[0][0][lane], node.bounds[0][1][lane], node.bounds[0][2][lane]);
+        bounds.merge(node.bounds[1][0][lane], node.bounds[1][1][lane], node.bounds[1][2][lane]);
+    }
+    return bounds;
+}
+
+void BVH::refit(const std::vector<AABB> &primBounds)
+{
+    // both builders hand out the children after their parent, so walking
+    // the nodes backwards visits every child before its parent
+    for(size_t n = nodes.size(); n-- > 0;){
+        BVHNode& node = nodes[n];
+        if(node.isLeaf()){
+            node.bounds = AABB();
+            for(unsigned int i = node.start; i < node.start + node.count; i++)
+                node.bounds.merge(primBounds[primIndices[i]]);
+        }
+        else{
+            node.bounds = nodes[node.start].bounds;
+            node.bounds.merge(nodes[node.start + 1].bounds);
+        }
+    }
+    // so does collapse() with the wide nodes
+    for(size_t w = wideNodes.size(); w-- > 0;){
+        BVH4Node& wide = wideNodes[w];
+        for(unsigned int lane = 0; lane < 4; lane++){
+            unsigned int ref = wide.child[lane];
+            if(ref == kEmptyChild)
+                continue;
+            if(ref & kLeafChild)
+                wide.setChild(lane, nodes[ref & ~kLeafChild].bounds, ref);
+            else
+                wide.setChild(lane, wideNodeBounds(wideNodes[ref]), ref);
+        }
+    }
+}
+
+bool BVH::valid(unsigned int primCount) const
+{
+    if(primIndices.size() != primCount || nodes.empty() != (primCount == 0))
+        return false;
+    for(size_t i = 0; i < primIndices.size(); i++){
+        if(primIndices[i] >= primCount)
+            return false;
+    }
+
+    // parents come first, so the depth of every node is known before its children are reached
+    std::vector<unsigned int> depth(nodes.size(), 0);
+    for(size_t n = 0; n < nodes.size(); n++){
+        const BVHNode& node = nodes[n];
+        if(node.isLeaf()){
+            if(node.count > primCount || node.start > primCount - node.count)
+                return false;
+            continue;
+        }
+        if(node.start <= n || node.start >= nodes.size() - 1 || depth[n] + 1 >= kMaxBVHDepth)
+            return false;
+        depth[node.start] = std::max(depth[node.start], depth[n] + 1);
+        depth[node.start + 1] = std::max(depth[node.start + 1], depth[n] + 1);
+    }
+
+    std::vector<unsigned int> wideDepth(wideNodes.size(), 0);
+    for(size_t w = 0; w < wideNodes.size(); w++){
+        for(int lane = 0; lane < 4; lane++){
+            unsigned int ref = wideNodes[w].child[lane];
+            if(ref == kEmptyChild)
+                continue;
+            if(ref & kLeafChild){
+                unsigned int leaf = ref & ~kLeafChild;
+                if(leaf >= nodes.size() || !nodes[leaf].isLeaf())
+                    return false;
+                continue;
+            }
+            if(ref <= w || ref >= wideNodes.size() || wideDepth[w] + 1 >= kMaxBVHDepth)
+                return false;
+            wideDepth[ref] = std::max(wideDepth[ref], wideDepth[w] + 1);
+        }
+    }
+    return true;
+}
+
+unsigned int BVH::collapse(unsigned int nodeIndex)
+{
+    // Start with the two children and keep opening the interior one with
+    // the largest surface area, the most likely to be entered, until there
+    // are four
+    unsigned int children[4] = {nodes[nodeIndex].start, nodes[nodeIndex].start + 1, 0, 0};
+    unsigned int count = 2;
+    while(count < 4){
+        int widest = -1;
+        float widestArea = -1.0f;
+        for(unsigned int i = 0; i < count; i++){
+            const BVHNode& node = nodes[children[i]];
+            if(!node.isLeaf() && node.bounds.surfaceArea() > widestArea){
+                widest = static_cast<int>(i);
+                widestArea = node.bounds.surfaceArea();
+            }
+        }
+        if(widest < 0)
+            break;
+        unsigned int opened = children[widest];
+        children[widest] = nodes[opened].start;
+        children[count++] = nodes[opened].start + 1;
+    }
+
+    unsigned int wideIndex = static_cast<unsigned int>(wideNodes.size());
+    wideNodes.push_back(BVH4Node());
+    for(unsigned int i = 0; i < count; i++){
+        const BVHNode& node = nodes[children[i]];
+        // the recursion grows wideNodes, so the new node is looked up again afterwards
+        unsigned int ref = node.isLeaf() ? (kLeafChild | children[i]) : collapse(children[i]);
+        wideNodes[wideIndex].setChild(i, node.bounds, ref);
+    }
+    return wideIndex;
+}
+
+void BVH::subdivide(BuildState& state, unsigned int nodeIndex, unsigned int depth)
+{
+    const std::vector<AABB>& primBounds = state.primBounds;
+    const std::vector<Vector>& centroids = state.centroids;
+    unsigned int start = nodes[nodeIndex].start;
+    unsigned int count = nodes[nodeIndex].count;
+    const unsigned int* prims = &primIndices[start];
+
+    // large nodes are scanned and binned in parallel
+    RangeBounds range;
+    reduceChunks(count, range, [&](unsigned int first, unsigned int last, RangeBounds& chunkRange){
+        for(unsigned int i = first; i < last; i++){
+            chunkRange.bounds.merge(primBounds[prims[i]]);
+            const Vector& c = centroids[prims[i]];
+            chunkRange.centroidBounds.merge(c.m_x, c.m_y, c.m_z);
+        }
+    });
+    const AABB& bounds = range.bounds;
+    const AABB& centroidBounds = range.centroidBounds;
+    nodes[nodeIndex].bounds = bounds;
+    if(count <= 1)
+        return;
+
+    // split along the axis with the largest centroid extent
+    int axis = 0;
+    float extent = centroidBounds.upper(0) - centroidBounds.lower(0);
+    for(int a = 1; a < 3; a++){
+        float e = centroidBounds.upper(a) - centroidBounds.lower(a);
+        if(e > extent){
+            axis = a;
+            extent = e;
+        }
+    }
+
+    unsigned int mid = start;
+    if(extent > 0.0f && depth < kMaxSAHDepth){
+        // bin the centroids and evaluate the SAH at every bin boundary
+        float binScale = kSAHBins / extent;
+        float axisMin = centroidBounds.lower(axis);
+        SAHBins bins;
+        reduceChunks(count, bins, [&](unsigned int first, unsigned int last, SAHBins& chunkBins){
+            for(unsigned int i = first; i < last; i++){
+                unsigned int prim = prims[i];
+                unsigned int b = static_cast<unsigned int>((axisValue(centroids[prim], axis) - axisMin) * binScale);
+                b = std::min(b, kSAHBins - 1);
+                chunkBins.count[b]++;
+                chunkBins.bounds[b].merge(primBounds[prim]);
+            }
+        });
+
+        float rightArea[kSAHBins];
+        unsigned int rightCount[kSAHBins];
+        AABB accum;
+        unsigned int accumCount = 0;
+        for(unsigned int b = kSAHBins - 1; b > 0; b--){
+            accum.merge(bins.bounds[b]);
+            accumCount += bins.count[b];
+            rightArea[b] = accum.surfaceArea();
+            rightCount[b] = accumCount;
+        }
+
+        float bestCost = kRayTMax;
+        unsigned int bestSplit = 0;
+        accum = AABB();
+        accumCount = 0;
+        for(unsigned int b = 1; b < kSAHBins; b++){
+            accum.merge(bins.bounds[b - 1]);
+            accumCount += bins.count[b - 1];
+            if(accumCount == 0 || rightCount[b] == 0)
+                continue;
+            float cost = accum.surfaceArea() * ceilDiv(accumCount, leafBlockSize) + rightArea[b] * ceilDiv(rightCount[b], leafBlockSize);
+            if(cost < bestCost){
+                bestCost = cost;
+                bestSplit = b;
+            }
+        }
+
+        float parentArea = bounds.surfaceArea();
+        float leafCost = kIntersectionCost * ceilDiv(count, leafBlockSize);
+        float splitCost = parentArea > 0.0f
+                ? kTraversalCost + kIntersectionCost * bestCost / parentArea
+                : leafCost;
+        if(bestSplit == 0 || (splitCost >= leafCost && count <= state.maxLeafSize))
+            mid = start;
+        else{
+            unsigned int *first = &primIndices[start];
+            unsigned int *last = first + count;
+            unsigned int *pivot = std::partition(first, last, [&](unsigned int prim){
+                unsigned int b = static_cast<unsigned int>((axisValue(centroids[prim], axis) - axisMin) * binScale);
+                return std::min(b, kSAHBins - 1) < bestSplit;
+            });
+            mid = start + static_cast<unsigned int>(pivot - first);
+        }
+    }
+
+    if(mid == start || mid == start + count){
+        if(count <= state.maxLeafSize)
+            return;
+        // no useful SAH split (e.g. coincident centroids), fall back to the median
+        mid = start + count / 2;
+        std::nth_element(primIndices.begin() + start,
+                         primIndices.begin() + mid,
+                         primIndices.begin() + start + count,
+                         [&](unsigned int a, unsigned int b){
+            return axisValue(centroids[a], axis) < axisValue(centroids[b], axis);
+        });
+    }
+
+    unsigned int left = state.allocatePair();
+    nodes[left].start = start;
+    nodes[left].count = mid - start;
+    nodes[left + 1].start = mid;
+    nodes[left + 1].count = start + count - mid;
+    nodes[nodeIndex].start = left;
+    nodes[nodeIndex].count = 0;
+    if(count >= kParallelSubtreeSize){
+        TaskGroup group;
+        group.run([this, &state, left, depth]{
+            subdivide(state, left, depth + 1);
+        });
+        subdivide(state, left + 1, depth + 1);
+        group.wait();
+    }
+    else{
+        subdivide(state, left, depth + 1);
+        subdivide(state, left + 1, depth + 1);
+    }
+}
+
+void BVH::sortMorton(BuildState& state, const AABB& centroidBounds)
+{
+    // quantize the centroids to a 1024^3 grid over their bounds; the code
+    // goes in the upper half of the key so that equal codes keep their order
+    unsigned int primNum = static_cast<unsigned int>(primIndices.size());
+    const float gridSize = float(1u << kMortonBits);
+    float scale[3];
+    for(int axis = 0; axis < 3; axis++){
+        float extent = centroidBounds.upper(axis) - centroidBounds.lower(axis);
+        scale[axis] = extent > 0.0f ? gridSize / extent : 0.0f;
+    }
+    std::vector<uint64_t> keys(primNum);
+    scanChunks(primNum, [&](unsigned int first, unsigned int last){
+        for(unsigned int i = first; i < last; i++){
+            unsigned int cell[3];
+            for(int axis = 0; axis < 3; axis++){
+                float offset = (axisValue(state.centroids[i], axis) - centroidBounds.lower(axis)) * scale[axis];
+                cell[axis] = std::min(static_cast<unsigned int>(offset), (1u << kMortonBits) - 1);
+            }
+            unsigned int code = (expandBits(cell[0]) << 2) | (expandBits(cell[1]) << 1) | expandBits(cell[2]);
+            keys[i] = (uint64_t(code) << 32) | i;
+        }
+    });
+
+    // least significant digit radix sort of the codes, kMortonBits per pass
+    std::vector<uint64_t> sorted(primNum);
+    const unsigned int digits = 1u << kMortonBits;
+    for(unsigned int shift = 32; shift < 32 + 3 * kMortonBits; shift += kMortonBits){
+        std::vector<unsigned int> offsets(digits + 1, 0);
+        for(unsigned int i = 0; i < primNum; i++)
+            offsets[((keys[i] >> shift) & (digits - 1)) + 1]++;
+        for(unsigned int d = 1; d <= digits; d++)
+            offsets[d] += offsets[d - 1];
+        for(unsigned int i = 0; i < primNum; i++)
+            sorted[offsets[(keys[i] >> shift) & (digits - 1)]++] = keys[i];
+        keys.swap(sorted);
+    }
+
+    state.mortonCodes.resize(primNum);
+    for(unsigned int i = 0; i < primNum; i++){
+        primIndices[i] = static_cast<unsigned int>(keys[i]);
+        state.mortonCodes[i] = static_cast<unsigned int>(keys[i] >> 32);
+    }
+}
+
+void BVH::buildMorton(BuildState& state, unsigned int nodeIndex, unsigned int start, unsigned int count)
+{
+    BVHNode& node = nodes[nodeIndex];
+    if(count <= state.maxLeafSize){
+        node.start = start;
+        node.count = count;
+        node.bounds = AABB();
+        for(unsigned int i = start; i < start + count; i++)
+            node.bounds.merge(state.primBounds[primIndices[i]]);
+        return;
+    }
+
+    // The codes of the range share their bits above the highest one in
+    // which its ends differ, the range splits where that bit turns on.
+    // Equal codes are split in the middle.
+    const unsigned int* codes = &state.mortonCodes[0];
+    unsigned int firstCode = codes[start];
+    unsigned int lastCode = codes[start + count - 1];
+    unsigned int mid = start + count / 2;
+    if(firstCode != lastCode){
+        unsigned int bit = 1u << highestBit(firstCode ^ lastCode);
+        mid = static_cast<unsigned int>(std::partition_point(codes + start, codes + start + count,
+                                                             [bit](unsigned int code){
+            return (code & bit) == 0;
+        }) - codes);
+    }
+
+    unsigned int left = state.allocatePair();
+    node.start = left;
+    node.count = 0;
+    if(count >= kParallelSubtreeSize){
+        TaskGroup group;
+        group.run([this, &state, left, start, mid]{
+            buildMorton(state, left, start, mid - start);
+        });
+        buildMorton(state, left + 1, mid, start + count - mid);
+        group.wait();
+    }
+    else{
+        buildMorton(state, left, start, mid - start);
+        buildMorton(state, left + 1, mid, start + count - mid);
+    }
+    node.bounds = nodes[left].bounds;
+    node.bounds.merge(nodes[left + 1].bounds);
+}
@@ -0,0 +1,388 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include <algorithm>
+#include "aabb.h"
+#include "renderstats.h"
+#include "raytracing/basic.h"
+
+struct BVHNode
+{
+    AABB bounds;
+    // interior node: index of the left child, the right child is stored right after it
+    // leaf node: index of the first primitive in primIndices
+    unsigned int start;
+    // number of primitives in a leaf, 0 for interior nodes
+    unsigned int count;
+
+    BVHNode() : start(0), count(0) { }
+
+    bool isLeaf() const { return count > 0; }
+};
+
+// Four children of a wide BVH node. The boxes are stored lane by lane,
+// bounds[0] the minimum and bounds[1] the maximum corners per axis, so that
+// one ray is tested against all of them at once. Unused lanes hold an
+// inverted box that no ray enters.
+struct BVH4Node
+{
+    float bounds[2][3][4];
+    // kEmptyChild, the index of a wide node, or kLeafChild | the index of a
+    // leaf in BVH::nodes
+    unsigned int child[4];
+
+    BVH4Node();
+    void setChild(unsigned int lane, const AABB& box, unsigned int ref);
+};
+
+const unsigned int kLeafChild = 0x80000000u;
+const unsigned int kEmptyChild = 0xffffffffu;
+
+// A ray broadcast to all lanes for the wide node tests, with the sign of
+// each direction component picking which corner holds the near plane
+struct WideRay
+{
+    Float4 origin[3];
+    Float4 invDirection[3];
+    int nearCorner[3];
+
+    explicit WideRay(const Ray& ray)
+    {
+        const float* o = &ray.m_origin.m_x;
+        const float* inv = &ray.m_invDirection.m_x;
+        for(int axis = 0; axis < 3; axis++){
+            origin[axis] = Float4(o[axis]);
+            invDirection[axis] = Float4(inv[axis]);
+            nearCorner[axis] = inv[axis] < 0.0f ? 1 : 0;
+        }
+    }
+};
+
+// Slab test of the ray against the four children within [0, tMax]. Returns
+// a bit per child that is hit and stores the entry distances in tEnter.
+inline int intersectChildren(const BVH4Node& node, const WideRay& ray, float tMax, float tEnter[4])
+{
+    Float4 tNear(0.0f);
+    Float4 tFar(tMax);
+    for(int axis = 0; axis < 3; axis++){
+        int nearCorner = ray.nearCorner[axis];
+        Float4 t0 = (Float4::load4(node.bounds[nearCorner][axis]) - ray.origin[axis]) * ray.invDirection[axis];
+        Float4 t1 = (Float4::load4(node.bounds[1 - nearCorner][axis]) - ray.origin[axis]) * ray.invDirection[axis];
+        // a ray lying in a slab plane gives 0 * inf = NaN, that slab is ignored
+        Float4 inSlabPlane = unordered(t0, t1);
+        tNear = max(select(inSlabPlane, Float4(-kRayTMax), t0), tNear);
+        tFar = min(select(inSlabPlane, Float4(kRayTMax), t1), tFar);
+    }
+    tNear.store4(tEnter);
+    return moveMask(lessEqual(tNear, tFar));
+}
+
+// How the traversals walk the tree: the binary SAH tree itself, or 4-wide
+// nodes collapsed from it, which test four boxes per step with SIMD
+enum BVHLayout {BinaryBVH, WideBVH};
+
+// the layout of the BVHs built from now on; WideBVH unless built with
+// RAYTRACING_BINARY_BVH defined
+void setBVHLayout(BVHLayout layout);
+BVHLayout bvhLayout();
+// "binary" or "wide"
+const char* bvhLayoutName(BVHLayout layout);
+
+// How the trees are built: top down with the binned surface area heuristic,
+// or from primitives sorted along a Morton curve (LBVH), several times
+// faster but with a tree that costs more to traverse, for quick previews
+enum BVHBuilder {SAHBuilder, MortonBuilder};
+
+// the builder of the BVHs built from now on, SAHBuilder by default
+void setBVHBuilder(BVHBuilder builder);
+BVHBuilder bvhBuilder();
+// "sah" or "morton"
+const char* bvhBuilderName(BVHBuilder builder);
+
+// the traversals keep their stacks on the stack, so trees must stay
+// shallower than this
+const unsigned int kMaxBVHDepth = 128;
+
+// Bounding volume hierarchy built with the surface area heuristic.
+// The hierarchy only knows the bounds of its primitives; the owner keeps
+// the primitives and tests them when a leaf is reached.
+// Large builds run on the shared task pool, the subtrees of a node are
+// built in parallel.
+class BVH
+{
+public:
+    std::vector<BVHNode> nodes;
+    // primitives in leaf order, leaves refer to ranges of this array
+    std::vector<unsigned int> primIndices;
+    // 4-wide nodes collapsed from the binary ones when built with the wide
+    // layout, empty otherwise; their leaves are the leaves of nodes
+    std::vector<BVH4Node> wideNodes;
+    // wall clock time of the last build, in ms
+    double buildTime;
+    // primitives are tested in groups of this size (SIMD leaves), the SAH
+    // counts the cost of a leaf per group
+    unsigned int leafBlockSize;
+
+    BVH() : buildTime(0.0), leafBlockSize(1) { }
+
+    void build(const std::vector<AABB>& primBounds, unsigned int leafBlockSize = 1);
+    // Recomputes the bounds of every node, binary and wide, from the new
+    // bounds of the same primitives, keeping the tree as it is. Much cheaper
+    // than a build, but the tree gets worse as the primitives move away
+    // from where it was built; compare sahCost() to decide when to rebuild.
+    void refit(const std::vector<AABB>& primBounds);
+    // Whether the tree is well formed over primCount primitives: every index
+    // in range, children stored after their parents and no deeper than
+    // kMaxBVHDepth. For trees that were not built here, e.g. read from a file.
+    bool valid(unsigned int primCount) const;
+    bool empty() const { return nodes.empty(); }
+
+    // Expected cost of a random ray that hits the root, in primitive tests:
+    // the traversal and leaf costs of every node weighted by its surface
+    // area relative to the root's. Lower is better, it compares the trees
+    // of different builders over the same primitives.
+    float sahCost() const;
+
+    // Visits the leaves hit by the ray nearest first. intersectLeaf(leaf, tMax)
+    // tests the primitives of a leaf, shrinks tMax when it finds a closer hit
+    // and returns whether it did; subtrees beyond tMax are skipped. The nodes
+    // visited and boxes tested are added to counts.
+    template<typename LeafFunc>
+    bool intersect(const Ray& ray, float& tMax, LeafFunc intersectLeaf, TraversalCounts& counts) const;
+
+    // Any-hit query: visits the leaves overlapping [0, tMax] in no particular
+    // order and stops as soon as occludedLeaf(leaf) returns true.
+    template<typename LeafFunc>
+    bool occluded(const Ray& ray, float tMax, LeafFunc occludedLeaf, TraversalCounts& counts) const;
+
+private:
+    // the shared state of a build, see bvh.cpp
+    struct BuildState;
+
+    void subdivide(BuildState& state, unsigned int nodeIndex, unsigned int depth);
+    void sortMorton(BuildState& state, const AABB& centroidBounds);
+    void buildMorton(BuildState& state, unsigned int nodeIndex, unsigned int start, unsigned int count);
+    unsigned int collapse(unsigned int nodeIndex);
+
+    template<typename LeafFunc>
+    bool intersectWide(const Ray& ray, float& tMax, LeafFunc intersectLeaf, TraversalCounts& counts) const;
+    template<typename LeafFunc>
+    bool occludedWide(const Ray& ray, float tMax, LeafFunc occludedLeaf, TraversalCounts& counts) const;
+};
+
+template<typename LeafFunc>
+bool BVH::intersect(const Ray& ray, float& tMax, LeafFunc intersectLeaf, TraversalCounts& counts) const
+{
+    if(nodes.empty())
+        return false;
+    if(!wideNodes.empty())
+        return intersectWide(ray, tMax, intersectLeaf, counts);
+    RaySlabs slabs(ray);
+    float tEnter, tExit;
+    if(!nodes[0].bounds.intersect(slabs, 0.0f, tMax, tEnter, tExit)){
+        counts.aabbTests++;
+        return false;
+    }
+
+    // the build keeps the tree shallow enough for a fixed size stack
+    struct StackEntry { unsigned int node; float tEnter; };
+    StackEntry stack[kMaxBVHDepth];
+    int top = 0;
+    stack[top].node = 0;
+    stack[top].tEnter = tEnter;
+    top++;
+
+    bool hit = false;
+    unsigned int nodesVisited = 0, aabbTests = 1;
+    while(top > 0){
+        StackEntry entry = stack[--top];
+        // a closer hit may have been found since this node was pushed
+        if(entry.tEnter > tMax)
+            continue;
+        const BVHNode& node = nodes[entry.node];
+        nodesVisited++;
+        if(node.isLeaf()){
+            if(intersectLeaf(node, tMax))
+                hit = true;
+            continue;
+        }
+        unsigned int nearChild = node.start;
+        unsigned int farChild = node.start + 1;
+        float tNear, tFar;
+        bool hitNear = nodes[nearChild].bounds.intersect(slabs, 0.0f, tMax, tNear, tExit);
+        bool hitFar = nodes[farChild].bounds.intersect(slabs, 0.0f, tMax, tFar, tExit);
+        aabbTests += 2;
+        if(hitNear && hitFar){
+            if(tFar < tNear){
+                std::swap(nearChild, farChild);
+                std::swap(tNear, tFar);
+            }
+            // push the far child first so that the near one is visited next
+            stack[top].node = farChild;
+            stack[top].tEnter = tFar;
+            top++;
+            stack[top].node = nearChild;
+            stack[top].tEnter = tNear;
+            top++;
+        }
+        else if(hitNear){
+            stack[top].node = nearChild;
+            stack[top].tEnter = tNear;
+            top++;
+        }
+        else if(hitFar){
+            stack[top].node = farChild;
+            stack[top].tEnter = tFar;
+            top++;
+        }
+    }
+    counts.nodesVisited += nodesVisited;
+    counts.aabbTests += aabbTests;
+    return hit;
+}
+
+template<typename LeafFunc>
+bool BVH::occluded(const Ray& ray, float tMax, LeafFunc occludedLeaf, TraversalCounts& counts) const
+{
+    if(nodes.empty())
+        return false;
+    if(!wideNodes.empty())
+        return occludedWide(ray, tMax, occludedLeaf, counts);
+    RaySlabs slabs(ray);
+    float tEnter, tExit;
+    if(!nodes[0].bounds.intersect(slabs, 0.0f, tMax, tEnter, tExit)){
+        counts.aabbTests++;
+        return false;
+    }
+
+    unsigned int stack[kMaxBVHDepth];
+    int top = 0;
+    stack[top++] = 0;
+    unsigned int nodesVisited = 0, aabbTests = 1;
+    while(top > 0){
+        const BVHNode& node = nodes[stack[--top]];
+        nodesVisited++;
+        if(node.isLeaf()){
+            if(occludedLeaf(node)){
+                counts.nodesVisited += nodesVisited;
+                counts.aabbTests += aabbTests;
+                return true;
+            }
+            continue;
+        }
+        for(unsigned int child = node.start; child < node.start + 2; child++){
+            if(nodes[child].bounds.intersect(slabs, 0.0f, tMax, tEnter, tExit))
+                stack[top++] = child;
+        }
+        aabbTests += 2;
+    }
+    counts.nodesVisited += nodesVisited;
+    counts.aabbTests += aabbTests;
+    return false;
+}
+
+template<typename LeafFunc>
+bool BVH::intersectWide(const Ray& ray, float& tMax, LeafFunc intersectLeaf, TraversalCounts& counts) const
+{
+    float tEnter, tExit;
+    if(!nodes[0].bounds.intersect(ray, 0.0f, tMax, tEnter, tExit)){
+        counts.aabbTests++;
+        return false;
+    }
+
+    // a wide node is no deeper than the binary one it was collapsed from and
+    // leaves at most three siblings behind per level
+    struct StackEntry { unsigned int child; float tEnter; };
+    StackEntry stack[3 * kMaxBVHDepth + 1];
+    int top = 0;
+    stack[top].child = 0;
+    stack[top].tEnter = tEnter;
+    top++;
+
+    WideRay wideRay(ray);
+    bool hit = false;
+    unsigned int nodesVisited = 0, aabbTests = 1;
+    while(top > 0){
+        StackEntry entry = stack[--top];
+        // a closer hit may have been found since this node was pushed
+        if(entry.tEnter > tMax)
+            continue;
+        nodesVisited++;
+        if(entry.child & kLeafChild){
+            if(intersectLeaf(nodes[entry.child & ~kLeafChild], tMax))
+                hit = true;
+            continue;
+        }
+        const BVH4Node& node = wideNodes[entry.child];
+        float tChild[4];
+        int mask = intersectChildren(node, wideRay, tMax, tChild);
+        aabbTests += 4;
+
+        // sort the children that were hit farthest first, so that the
+        // nearest one ends up on top of the stack
+        StackEntry sorted[4];
+        int count = 0;
+        for(int i = 0; i < 4; i++){
+            if(!(mask & (1 << i)))
+                continue;
+            int j = count++;
+            while(j > 0 && sorted[j - 1].tEnter < tChild[i]){
+                sorted[j] = sorted[j - 1];
+                j--;
+            }
+            sorted[j].child = node.child[i];
+            sorted[j].tEnter = tChild[i];
+        }
+        for(int i = 0; i < count; i++)
+            stack[top++] = sorted[i];
+    }
+    counts.nodesVisited += nodesVisited;
+    counts.aabbTests += aabbTests;
+    return hit;
+}
+
+template<typename LeafFunc>
+bool BVH::occludedWide(const Ray& ray, float tMax, LeafFunc occludedLeaf, TraversalCounts& counts) const
+{
+    float tEnter, tExit;
+    if(!nodes[0].bounds.intersect(ray, 0.0f, tMax, tEnter, tExit)){
+        counts.aabbTests++;
+        return false;
+    }
+
+    unsigned int stack[3 * kMaxBVHDepth + 1];
+    int top = 0;
+    stack[top++] = 0;
+    WideRay wideRay(ray);
+    unsigned int nodesVisited = 0, aabbTests = 1;
+    while(top > 0){
+        unsigned int child = stack[--top];
+        nodesVisited++;
+        if(child & kLeafChild){
+            if(occludedLeaf(nodes[child & ~kLeafChild])){
+                counts.nodesVisited += nodesVisited;
+                counts.aabbTests += aabbTests;
+                return true;
+            }
+            continue;
+        }
+        const BVH4Node& node = wideNodes[child];
+        float tChild[4];
+        int mask = intersectChildren(node, wideRay, tMax, tChild);
+        aabbTests += 4;
+        for(int i = 0; i < 4; i++){
+            if(mask & (1 << i))
+                stack[top++] = node.child[i];
+        }
+    }
+    counts.nodesVisited += nodesVisited;
+    counts.aabbTests += aabbTests;
+    return false;
+}
+
+// copied byte for byte by the model cache
+static_assert(std::is_trivially_copyable<BVHNode>::value, "BVHNode must stay trivially copyable");
+static_assert(std::is_trivially_copyable<BVH4Node>::value, "BVH4Node must stay trivially copyable");
+
+#endif // BVH_H
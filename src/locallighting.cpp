@@ -5,40 +5,45 @@
 #include "light.h"
 #include "mesh.h"
 #include "scene.h"
+#include "renderstats.h"
 
 
 Color PhongLighting(Point &intersect,
                     Vector& normal,
                     const Vector &direction,
+                    float distance,
                     Scene& scene,
+                    const std::vector<bool>& lightFlag,
                     QVector3D ka, QVector3D ks, double n)
 {
     Color color;
+    // the vector math runs in SIMD registers, loaded once per hit
+    Float4 position = toFloat4(intersect);
+    Float4 surfaceNormal = toFloat4(normal);
+    Float4 view = Float4(0.0f) - toFloat4(direction);
     size_t light_num = scene.lights.size();
     for(size_t i=0; i<light_num; i++){
-        if(!scene.lightFlag[i]) continue;
-        if(inShadow(intersect, scene, scene.lights[i])) continue;
+        if(i < lightFlag.size() && !lightFlag[i]) continue;
+        if(inShadow(intersect, normal, distance, scene, scene.lights[i])) continue;
         // ambient
         Color ambient = ka * scene.lights[i]->m_color;
         // diffuse
         // assume that direction and normal is already normalized
-        Vector light_direction;
+        Float4 light_direction;
         if(scene.lights[i]->m_type == Light::PointLight){
             PointLight* pointLight = (PointLight*)scene.lights[i];
-            light_direction = pointLight->m_position - intersect;
-            light_direction = light_direction.normalized();
+            light_direction = normalize3(toFloat4(pointLight->m_position) - position);
         }
         else{ // parallel light
             ParallelLight* parallelLight = (ParallelLight*)scene.lights[i];
-            light_direction = parallelLight->m_direction;
+            light_direction = toFloat4(parallelLight->m_direction);
         }
-        float diff = dot(normal, light_direction);
+        float diff = dot3(surfaceNormal, light_direction);
         diff = diff < 0.0f ? 0.0f : diff;
         Color diffuse = diff * scene.lights[i]->m_color;
         // specular
-        Vector reflection = reflect(light_direction, normal);
-        Vector view(-direction);
-        float spec = dot(view, reflection);
+        Float4 reflection = normalize3(reflect3(light_direction, surfaceNormal));
+        float spec = dot3(view, reflection);
         spec = spec < 0.0f ? 0.0f : spec;
         spec = float(pow(double(spec), n));
         Color specular = spec * ks * scene.lights[i]->m_color;
@@ -47,23 +52,24 @@ Color PhongLighting(Point &intersect,
     return color;
 }
 
-bool inShadow(Point &intersect, Scene &scene, Light *light)
+bool inShadow(Point &intersect, const Vector& normal, float distance, Scene &scene, Light *light)
 {
+    // shadow rays only need to know whether something is in the way
+    threadRenderStats().shadowRays++;
     if(light->m_type == Light::PointLight){
         PointLight *pointLight = (PointLight*)light;
-        Vector direction = intersect - pointLight->m_position;
-        direction = direction.normalized();
-        Ray lightRay(pointLight->m_position, direction);
-        Intersection intersection(lightRay);
-        scene.intersect(intersection);
-        return !(intersection.m_intersect == intersect);
+        Point origin = offsetRayOrigin(intersect, normal, pointLight->m_position - intersect, distance);
+        Vector toLight = pointLight->m_position - origin;
+        float lightDistance = toLight.normalize();
+        Ray shadowRay(origin, toLight);
+        return scene.occluded(shadowRay, lightDistance);
     }
     else{
         // parallel light
         ParallelLight *parallelLight = (ParallelLight*)light;
+        // the light's direction is normalized already
         Vector direction(-parallelLight->m_direction);
-        Ray lightRay(intersect, direction);
-        Intersection intersection(lightRay);
-        return scene.intersect(intersection);
+        Ray shadowRay(offsetRayOrigin(intersect, normal, direction, distance), direction);
+        return scene.occluded(shadowRay, kRayTMax);
     }
 }
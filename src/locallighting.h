@@ -9,11 +9,16 @@ class Light;
 class Texture;
 class Scene;
 
-bool inShadow(Point& intersect, Scene& scene, Light* light);
+// distance is how far the ray that found intersect travelled, the shadow ray
+// starts off the surface by an amount that grows with it
+bool inShadow(Point& intersect, const Vector& normal, float distance, Scene& scene, Light* light);
+// lights whose entry in lightFlag is false are skipped, lights without an entry are on
 Color PhongLighting(Point& intersect,
                     Vector& normal,
                     const Vector& direction,
+                    float distance,
                     Scene& scene,
+                    const std::vector<bool>& lightFlag,
                     QVector3D ka, QVector3D ks, double n);
 
 #endif // LOCALLIGHTING_H
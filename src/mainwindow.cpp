@@ -30,7 +30,7 @@ MainWindow::MainWindow(QWidget *parent) :
     this->setCentralWidget(widget);
 
     // load scene from file
-    scene = new Scene("./scene/scene.json", widget);
+    scene = new Scene("./scene/scene.json");
     scene->loadSceneExceptModels();
     widget->scene = scene;
     widget->camera = new Camera(scene->camera_position,
@@ -175,6 +175,9 @@ MainWindow::MainWindow(QWidget *parent) :
 
 MainWindow::~MainWindow()
 {
+    // the dialog stops and waits for a running render, which still reads
+    // the scene and the camera
+    delete rayTracingDialog;
     delete ui;
     delete scene;
     delete perspectiveCamera;
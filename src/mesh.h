@@ -18,6 +18,9 @@
 using namespace std;
 
 #include "aabb.h"
+#include "bvh.h"
+#include "triangleblock.h"
+#include "renderstats.h"
 #include "raytracing/basic.h"
 
 struct Vertex {
@@ -37,6 +40,12 @@ struct Face {
     std::vector<unsigned int> vertexIndices;
 };
 
+struct Triangle {
+    unsigned int v0, v1, v2;
+};
+
+// pixels of a texture as decoded from the file; id is the GL texture, 0
+// until the model is drawn for the first time
 struct Texture {
     unsigned int id;
     string type;
@@ -56,26 +65,39 @@ public:
     vector<Texture> textures;
     unsigned int VAO;
     AABB aabb;
+    // faces split into triangles, stored in BVH leaf order
+    vector<Triangle> triangles;
+    BVH bvh;
+    // triangle positions of every leaf packed for the SIMD kernel
+    vector<TriangleBlock> triangleBlocks;
+    // first block of each leaf, indexed by BVH node
+    vector<unsigned int> leafFirstBlock;
 
     /*  Functions  */
     // constructor
+    // The mesh data stays on the CPU, so meshes can be loaded on any thread
+    // and ray traced without a GL context. The vertex buffers are created the
+    // first time the mesh is drawn, and the ray tracing BVH is built
+    // separately with buildBVH() so that the meshes of a model can be built
+    // in parallel.
     Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Face> faces,
-         vector<Texture> textures, AABB aabb,
-         QOpenGLFunctions_3_3_Core &core)
+         vector<Texture> textures, AABB aabb)
+        : VAO(0), VBO(0), EBO(0)
     {
         this->vertices = vertices;
         this->indices = indices;
         this->faces = faces;
         this->textures = textures;
         this->aabb = aabb;
-
-        // now that we have all the required data, set the vertex buffers and its attribute pointers.
-        setupMesh(core);
     }
 
-    // render the mesh
+    // render the mesh, uploads it first if it is not on the GPU yet; the
+    // texture ids must have been set by the model
     void Draw(QOpenGLShaderProgram& shader, QOpenGLFunctions_3_3_Core &core)
     {
+        if(VAO == 0)
+            setupMesh(core);
+
         // bind appropriate textures
         unsigned int diffuseNr  = 1;
         unsigned int specularNr = 1;
@@ -111,21 +133,115 @@ public:
         core.glActiveTexture(GL_TEXTURE0);
     }
 
-    bool intersect(Intersection& intersection){
-        if(!aabb.intersect(intersection)){
-            return false;
+    // closest hit of the model space ray, updates the intersection if it is
+    // closer than intersection.m_t; the work done is added to counts
+    bool intersect(const Ray& ray, Intersection& intersection, TraversalCounts& counts) const
+    {
+        float tClosest = intersection.m_t;
+        const BVHNode* firstNode = bvh.nodes.data();
+        unsigned int triangleTests = 0;
+        bool found = bvh.intersect(ray, tClosest, [&](const BVHNode& leaf, float& tMax){
+            const TriangleBlock* blocks = &triangleBlocks[leafFirstBlock[&leaf - firstNode]];
+            unsigned int blockNum = (leaf.count + kTriangleBlockWidth - 1) / kTriangleBlockWidth;
+            triangleTests += leaf.count;
+            TriangleHit hit;
+            if(!intersectTriangleBlocks(blocks, blockNum, ray, tMax, hit))
+                return false;
+            // the kernel was bounded by the closest hit, so this one is closer
+            intersection.m_t = hit.t;
+            intersection.m_primIndex = hit.primIndex;
+            intersection.m_u = hit.u;
+            intersection.m_v = hit.v;
+            tMax = hit.t;
+            return true;
+        }, counts);
+        counts.triangleTests += triangleTests;
+        return found;
+    }
+
+    // model space normal (not normalized) and texture coordinates of a
+    // triangle at barycentric weights u (vertex 1) and v (vertex 2)
+    void interpolate(unsigned int primIndex, float u, float v,
+                     Vector& normal, float& texU, float& texV) const
+    {
+        const Triangle& triangle = triangles[primIndex];
+        const Vertex& vertex1 = vertices[triangle.v0];
+        const Vertex& vertex2 = vertices[triangle.v1];
+        const Vertex& vertex3 = vertices[triangle.v2];
+        float alpha = 1.0f - u - v;
+
+        // Weight normals at each vertex by barycentric coords to create
+        // the interpolated normal at the intersection point.
+        normal = (Vector(vertex1.Normal) * alpha) +
+                 (Vector(vertex2.Normal) * u) +
+                 (Vector(vertex3.Normal) * v);
+        texU = vertex1.TexCoords.x * alpha + vertex2.TexCoords.x * u + vertex3.TexCoords.x * v;
+        texV = vertex1.TexCoords.y * alpha + vertex2.TexCoords.y * u + vertex3.TexCoords.y * v;
+    }
+
+    // true if a triangle blocks the ray within [kRayTMin, tMax), the ray is in model space
+    bool occluded(const Ray& ray, float tMax, TraversalCounts& counts) const
+    {
+        const BVHNode* firstNode = bvh.nodes.data();
+        unsigned int triangleTests = 0;
+        bool found = bvh.occluded(ray, tMax, [&](const BVHNode& leaf){
+            const TriangleBlock* blocks = &triangleBlocks[leafFirstBlock[&leaf - firstNode]];
+            unsigned int blockNum = (leaf.count + kTriangleBlockWidth - 1) / kTriangleBlockWidth;
+            triangleTests += leaf.count;
+            return occludedTriangleBlocks(blocks, blockNum, ray, tMax);
+        }, counts);
+        counts.triangleTests += triangleTests;
+        return found;
+    }
+
+    // splits the faces into triangles and builds the BVH over them
+    void buildBVH()
+    {
+        triangles.clear();
+        for(size_t i = 0; i < faces.size(); i++){
+            const vector<unsigned int>& indices = faces[i].vertexIndices;
+            for(size_t j = 1; j + 1 < indices.size(); j++){
+                Triangle triangle = {indices[0], indices[j], indices[j + 1]};
+                triangles.push_back(triangle);
+            }
+        }
+
+        vector<AABB> triangleBounds(triangles.size());
+        for(size_t i = 0; i < triangles.size(); i++){
+            const glm::vec3& p0 = vertices[triangles[i].v0].Position;
+            const glm::vec3& p1 = vertices[triangles[i].v1].Position;
+            const glm::vec3& p2 = vertices[triangles[i].v2].Position;
+            triangleBounds[i].merge(p0.x, p0.y, p0.z);
+            triangleBounds[i].merge(p1.x, p1.y, p1.z);
+            triangleBounds[i].merge(p2.x, p2.y, p2.z);
         }
-        bool flag = false;
-        size_t num_face = faces.size();
-        for(size_t i=0; i<num_face; i++){
-            size_t num_vertice = faces[i].vertexIndices.size();
-            for(size_t j=1; j<=num_vertice-2; j++){
-                if(intersectTriangle(faces[i], j, intersection)){
-                    flag = true;
-                }
+        bvh.build(triangleBounds, kTriangleBlockWidth);
+
+        // store the triangles in leaf order so that leaves address them directly
+        vector<Triangle> ordered(triangles.size());
+        for(size_t i = 0; i < bvh.primIndices.size(); i++)
+            ordered[i] = triangles[bvh.primIndices[i]];
+        triangles.swap(ordered);
+
+        // pack the triangles of every leaf into blocks
+        triangleBlocks.clear();
+        leafFirstBlock.assign(bvh.nodes.size(), 0);
+        for(size_t n = 0; n < bvh.nodes.size(); n++){
+            const BVHNode& node = bvh.nodes[n];
+            if(!node.isLeaf())
+                continue;
+            leafFirstBlock[n] = static_cast<unsigned int>(triangleBlocks.size());
+            for(unsigned int i = 0; i < node.count; i++){
+                if(i % kTriangleBlockWidth == 0)
+                    triangleBlocks.push_back(TriangleBlock());
+                const Triangle& triangle = triangles[node.start + i];
+                triangleBlocks.back().setTriangle(i % kTriangleBlockWidth,
+                                                  Point(vertices[triangle.v0].Position),
+                                                  Point(vertices[triangle.v1].Position),
+                                                  Point(vertices[triangle.v2].Position),
+                                                  node.start + i);
             }
         }
-        return flag;
     }
 
 private:
@@ -171,72 +287,5 @@ private:
 
         core.glBindVertexArray(0);
     }
-
-    bool intersectTriangle(Face& face, unsigned int tri, Intersection& intersection)
-    {
-        unsigned int v0 = face.vertexIndices[0];
-        unsigned int v1 = face.vertexIndices[tri];
-        unsigned int v2 = face.vertexIndices[tri + 1];
-
-        Vector v0To1(Vector(vertices[v1].Position - vertices[v0].Position));
-        Vector v0To2(Vector(vertices[v2].Position - vertices[v0].Position));
-        Vector gnormal = cross(v0To1, v0To2);
-        float det = -dot(intersection.m_ray.m_direction, gnormal);
-        if (det == 0.0f)
-            return false;
-
-        Vector rOriginToV0 = Vector(vertices[v0].Position) - intersection.m_ray.m_origin;
-        Vector rayVertCross = cross(intersection.m_ray.m_direction, rOriginToV0);
-        Vector rOriginToV1 = Vector(vertices[v1].Position) - intersection.m_ray.m_origin;
-        float invDet = 1.0f / det;
-
-        // Calculate barycentric gamma coord
-        float gamma = -dot(rOriginToV1, rayVertCross) * invDet;
-        if (gamma < 0.0f || gamma > 1.0f)
-            return false;
-
-        Vector rOriginToV2 = Vector(vertices[v2].Position) - intersection.m_ray.m_origin;
-
-        // Calculate barycentric beta coord
-        float beta = dot(rOriginToV2, rayVertCross) * invDet;
-        if (beta < 0.0f || beta + gamma > 1.0f)
-            return false;
-
-        float t = -dot(rOriginToV0, gnormal) * invDet;
-        if (t < kRayTMin || t >= intersection.m_t)
-            return false;
-
-        float alpha = 1.0f - beta - gamma;
-
-        // Calculate shading normal...
-        Vector shadingNormal;
-        Vector normal1(vertices[v0].Normal);
-        Vector normal2(vertices[v1].Normal);
-        Vector normal3(vertices[v2].Normal);
-
-        // Weight normals at each vertex by barycentric coords to create
-        // the interpolated normal at the intersection point.
-        shadingNormal = (normal1 * alpha) +
-                        (normal2 * beta) +
-                        (normal3 * gamma);
-        shadingNormal.normalize();
-
-        if(intersection.model_intersected){
-            if(t < intersection.m_model_t){
-                intersection.m_model_t = t;
-                intersection.m_model_intersect = intersection.model_intersect(t);
-                intersection.m_model_normal = shadingNormal;
-                return true;
-            }
-        }
-        else{
-            intersection.model_intersected = true;
-            intersection.m_model_t = t;
-            intersection.m_model_intersect = intersection.model_intersect(t);
-            intersection.m_model_normal = shadingNormal;
-            return true;
-        }
-        return false;
-    }
 };
 #endif
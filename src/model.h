@@ -6,9 +6,10 @@
 #include <QOpenGLShaderProgram>
 
 #include "aabb.h"
+#include "raytracing/basic.h"
 
-class Intersection;
 class Color;
+struct TraversalCounts;
 
 class Model
 {
@@ -22,18 +23,43 @@ public:
     QVector3D kt;
     double n;
 
-    // model matrix
-    QMatrix4x4 modelMatrix;
-
     // AABB
     AABB aabb;
 
-    Model(){
+    // set whenever the model matrix changes, cleared by the scene once its
+    // top level BVH has caught up with the new placement
+    bool transformDirty;
+
+    Model() : transformDirty(true){
         type = MODEL;
     }
-    ~Model(){}
+    virtual ~Model(){}
+    const QMatrix4x4& modelMatrix() const { return m_modelMatrix; }
+    // the only way to move the model, keeps the matrices below and
+    // transformDirty in sync
+    void setModelMatrix(const QMatrix4x4& matrix){
+        m_modelMatrix = matrix;
+        QMatrix4x4 inverse = matrix.inverted();
+        worldToModel = Matrix3x4(inverse);
+        normalToWorld = Matrix3x4(inverse.transposed());
+        transformDirty = true;
+    }
     void Draw(QOpenGLShaderProgram& shader, QOpenGLFunctions_3_3_Core &core){}
-    virtual bool intersect(Intersection& intersection) = 0;
+    // updates the hit if the ray, in world space, hits this model closer than
+    // intersection.m_t; the traversal work below the model's box test is
+    // added to counts, the caller counts the box test itself
+    virtual bool intersect(const Ray& ray, Intersection& intersection, TraversalCounts& counts) = 0;
+    // shading attributes of a hit of the world space ray on this model
+    virtual SurfaceInteraction surfaceInteraction(const Ray& ray, const Intersection& intersection) const = 0;
+    // any-hit query for shadow rays, ray is in world space
+    virtual bool occluded(const Ray& ray, float tMax, TraversalCounts& counts) = 0;
+
+protected:
+    Matrix3x4 worldToModel;  // inverse of the model matrix
+    Matrix3x4 normalToWorld; // inverse transpose of the model matrix
+
+private:
+    QMatrix4x4 m_modelMatrix;
 };
 
 #endif // MODEL_H
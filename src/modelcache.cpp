@@ -0,0 +1,418 @@
+#include "modelcache.h"
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+
+// bump when anything stored changes meaning
+const quint32 kCacheVersion = 1;
+const char kCacheMagic[8] = {'R', 'O', 'V', 'E', 'R', 'M', 'C', '\0'};
+// every array starts at a multiple of this
+const qint64 kCacheAlignment = 16;
+
+struct CacheHeader
+{
+    char magic[8];
+    quint32 version;
+    // sizes of the stored structures, so that a build with another layout
+    // of them reads no entry written by this one
+    quint32 vertexSize;
+    quint32 nodeSize;
+    quint32 wideNodeSize;
+    quint32 blockSize;
+    quint32 meshCount;
+};
+
+// Followed by the arrays of the mesh in this order: vertices, indices, the
+// index count of every face, the triangles, the BVH nodes, the primitive
+// order, the wide nodes, the triangle blocks, the first block of every
+// leaf, the type and path lengths of the textures and their characters
+struct CachedMesh
+{
+    AABB aabb;
+    quint32 vertexCount;
+    quint32 indexCount;
+    quint32 faceCount;
+    quint32 triangleCount;
+    quint32 nodeCount;
+    quint32 wideNodeCount;
+    quint32 blockCount;
+    quint32 leafBlockSize;
+    quint32 textureCount;
+};
+
+// the arrays are copied to and from the file byte for byte
+static_assert(std::is_trivially_copyable<CacheHeader>::value, "CacheHeader must stay trivially copyable");
+static_assert(std::is_trivially_copyable<CachedMesh>::value, "CachedMesh must stay trivially copyable");
+static_assert(std::is_trivially_copyable<Vertex>::value, "Vertex must stay trivially copyable");
+static_assert(std::is_trivially_copyable<Triangle>::value, "Triangle must stay trivially copyable");
+static_assert(std::is_trivially_copyable<TriangleBlock>::value, "TriangleBlock must stay trivially copyable");
+
+static QMutex s_directoryMutex;
+static bool s_directorySet = false;
+static QString s_directory;
+
+void setModelCacheDirectory(const QString &directory)
+{
+    QMutexLocker locker(&s_directoryMutex);
+    s_directory = directory;
+    s_directorySet = true;
+}
+
+QString modelCacheDirectory()
+{
+    QMutexLocker locker(&s_directoryMutex);
+    if(!s_directorySet){
+        s_directory = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+        if(!s_directory.isEmpty())
+            s_directory += "/models";
+        s_directorySet = true;
+    }
+    return s_directory;
+}
+
+static QString cacheFileName(const QByteArray& key)
+{
+    return modelCacheDirectory() + "/" + QString::fromLatin1(key) + ".bin";
+}
+
+static qint64 alignCacheOffset(qint64 offset)
+{
+    return (offset + kCacheAlignment - 1) / kCacheAlignment * kCacheAlignment;
+}
+
+// Adds the material libraries the OBJ file refers to with mtllib lines to
+// the hash, so that editing one of them changes the key too. As the
+// importer does, the rest of the line is taken as one file name, relative
+// to the directory of the model.
+static void addMaterialLibraries(QCryptographicHash& hash, const QString& directory, const char* data, qint64 size)
+{
+    static const char keyword[] = "mtllib";
+    const qint64 keywordLength = sizeof(keyword) - 1;
+    const char* end = data + size;
+    for(const char* line = data; line < end; ){
+        const char* lineEnd = static_cast<const char*>(std::memchr(line, '\n', size_t(end - line)));
+        if(!lineEnd)
+            lineEnd = end;
+        const char* c = line;
+        while(c < lineEnd && (*c == ' ' || *c == '\t'))
+            c++;
+        if(lineEnd - c > keywordLength && std::memcmp(c, keyword, size_t(keywordLength)) == 0 &&
+           (c[keywordLength] == ' ' || c[keywordLength] == '\t')){
+            QString name = QString::fromLatin1(QByteArray(c + keywordLength, int(lineEnd - c - keywordLength))).trimmed();
+            QFile library(directory + "/" + name);
+            hash.addData(name.toLatin1());
+            // a missing library hashes differently from any existing one
+            if(library.open(QIODevice::ReadOnly))
+                hash.addData(library.readAll());
+            else
+                hash.addData(QByteArray("\0missing", 8));
+        }
+        line = lineEnd + 1;
+    }
+}
+
+QByteArray modelCacheKey(const std::string &path, unsigned int importerFlags)
+{
+    if(modelCacheDirectory().isEmpty())
+        return QByteArray();
+    QFile file(QString::fromStdString(path));
+    if(!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+
+    qint64 size = file.size();
+    const uchar* data = size > 0 ? file.map(0, size) : nullptr;
+    QByteArray contents;
+    if(!data && size > 0){
+        contents = file.readAll();
+        if(contents.size() != size)
+            return QByteArray();
+        data = reinterpret_cast<const uchar*>(contents.constData());
+    }
+
+    // the hash only guards against stale entries, so the fastest one will do
+    QCryptographicHash hash(QCryptographicHash::Md5);
+    // addData takes at most 2 GB at a time
+    const qint64 step = qint64(1) << 30;
+    for(qint64 offset = 0; offset < size; offset += step)
+        hash.addData(reinterpret_cast<const char*>(data + offset), int(std::min(step, size - offset)));
+    addMaterialLibraries(hash, QFileInfo(file.fileName()).path(), reinterpret_cast<const char*>(data), size);
+
+    QString settings = QString(" %1 %2 %3 %4 %5").arg(kCacheVersion).arg(importerFlags)
+            .arg(bvhBuilderName(bvhBuilder())).arg(bvhLayoutName(bvhLayout())).arg(kTriangleBlockWidth);
+    hash.addData(settings.toLatin1());
+    return hash.result().toHex();
+}
+
+// Writes the cache file, padding every item to kCacheAlignment
+class CacheWriter
+{
+public:
+    explicit CacheWriter(QIODevice& device) : m_device(device), m_offset(0), m_ok(true) { }
+
+    void write(const void* data, qint64 size)
+    {
+        static const char padding[kCacheAlignment] = {0};
+        if(!m_ok || size == 0)
+            return;
+        qint64 end = alignCacheOffset(m_offset + size);
+        m_ok = m_device.write(static_cast<const char*>(data), size) == size &&
+               m_device.write(padding, end - m_offset - size) == end - m_offset - size;
+        m_offset = end;
+    }
+
+    template<typename T>
+    void writeArray(const vector<T>& array)
+    {
+        write(array.data(), qint64(array.size() * sizeof(T)));
+    }
+
+    bool ok() const { return m_ok; }
+
+private:
+    QIODevice& m_device;
+    qint64 m_offset;
+    bool m_ok;
+};
+
+// Reads the items of a mapped cache file, failing on the first one that
+// would run past its end
+class CacheReader
+{
+public:
+    CacheReader(const uchar* data, qint64 size) : m_data(data), m_size(size), m_offset(0), m_ok(true) { }
+
+    // start of the next item of the given size, nullptr if there is none
+    const uchar* next(qint64 size)
+    {
+        if(!m_ok || size > m_size - m_offset){
+            m_ok = false;
+            return nullptr;
+        }
+        const uchar* item = m_data + m_offset;
+        m_offset = std::min(alignCacheOffset(m_offset + size), m_size);
+        return item;
+    }
+
+    bool read(void* data, qint64 size)
+    {
+        const uchar* item = next(size);
+        if(item)
+            std::memcpy(data, item, size_t(size));
+        return item != nullptr;
+    }
+
+    template<typename T>
+    bool readArray(vector<T>& array, quint32 count)
+    {
+        const T* item = reinterpret_cast<const T*>(next(qint64(count) * qint64(sizeof(T))));
+        if(item)
+            array.assign(item, item + count);
+        return item != nullptr;
+    }
+
+    void fail() { m_ok = false; }
+    bool ok() const { return m_ok; }
+
+private:
+    const uchar* m_data;
+    qint64 m_size;
+    qint64 m_offset;
+    bool m_ok;
+};
+
+// Whether every index stored in a mesh read from the cache is in range, so
+// that a damaged entry is a miss rather than a crash in the renderer
+static bool validCachedMesh(const Mesh& mesh)
+{
+    size_t vertexCount = mesh.vertices.size();
+    for(size_t i = 0; i < mesh.indices.size(); i++){
+        if(mesh.indices[i] >= vertexCount)
+            return false;
+    }
+    for(size_t i = 0; i < mesh.triangles.size(); i++){
+        const Triangle& triangle = mesh.triangles[i];
+        if(triangle.v0 >= vertexCount || triangle.v1 >= vertexCount || triangle.v2 >= vertexCount)
+            return false;
+    }
+
+    unsigned int triangleCount = static_cast<unsigned int>(mesh.triangles.size());
+    if(!mesh.bvh.valid(triangleCount) || mesh.leafFirstBlock.size() != mesh.bvh.nodes.size())
+        return false;
+    size_t blockCount = mesh.triangleBlocks.size();
+    for(size_t n = 0; n < mesh.bvh.nodes.size(); n++){
+        const BVHNode& node = mesh.bvh.nodes[n];
+        size_t blockNum = (node.count + kTriangleBlockWidth - 1) / kTriangleBlockWidth;
+        if(node.isLeaf() && (mesh.leafFirstBlock[n] > blockCount || blockNum > blockCount - mesh.leafFirstBlock[n]))
+            return false;
+    }
+    for(size_t b = 0; b < blockCount; b++){
+        for(unsigned int lane = 0; lane < kTriangleBlockWidth; lane++){
+            if(mesh.triangleBlocks[b].primIndex[lane] >= triangleCount)
+                return false;
+        }
+    }
+    return true;
+}
+
+static CacheHeader makeCacheHeader(quint32 meshCount)
+{
+    CacheHeader header;
+    std::memcpy(header.magic, kCacheMagic, sizeof(header.magic));
+    header.version = kCacheVersion;
+    header.vertexSize = sizeof(Vertex);
+    header.nodeSize = sizeof(BVHNode);
+    header.wideNodeSize = sizeof(BVH4Node);
+    header.blockSize = sizeof(TriangleBlock);
+    header.meshCount = meshCount;
+    return header;
+}
+
+bool readModelCache(const QByteArray &key, vector<Mesh> &meshes)
+{
+    QFile file(cacheFileName(key));
+    if(!file.open(QIODevice::ReadOnly))
+        return false;
+    qint64 size = file.size();
+    const uchar* data = size > 0 ? file.map(0, size) : nullptr;
+    if(!data)
+        return false;
+
+    CacheReader reader(data, size);
+    CacheHeader header;
+    CacheHeader expected = makeCacheHeader(0);
+    if(!reader.read(&header, sizeof(header)) ||
+       std::memcmp(&header, &expected, offsetof(CacheHeader, meshCount)) != 0)
+        return false;
+
+    size_t first = meshes.size();
+    for(quint32 m = 0; m < header.meshCount && reader.ok(); m++){
+        CachedMesh info;
+        if(!reader.read(&info, sizeof(info)))
+            break;
+        meshes.push_back(Mesh(vector<Vertex>(), vector<unsigned int>(), vector<Face>(),
+                              vector<Texture>(), info.aabb));
+        Mesh& mesh = meshes.back();
+        vector<unsigned int> faceSizes;
+        reader.readArray(mesh.vertices, info.vertexCount);
+        reader.readArray(mesh.indices, info.indexCount);
+        reader.readArray(faceSizes, info.faceCount);
+        reader.readArray(mesh.triangles, info.triangleCount);
+        reader.readArray(mesh.bvh.nodes, info.nodeCount);
+        reader.readArray(mesh.bvh.primIndices, info.triangleCount);
+        reader.readArray(mesh.bvh.wideNodes, info.wideNodeCount);
+        reader.readArray(mesh.triangleBlocks, info.blockCount);
+        reader.readArray(mesh.leafFirstBlock, info.nodeCount);
+        mesh.bvh.leafBlockSize = info.leafBlockSize;
+        vector<quint32> stringLengths;
+        reader.readArray(stringLengths, 2 * info.textureCount);
+        for(quint32 t = 0; t < info.textureCount && reader.ok(); t++){
+            Texture texture = {0, string(), string(), nullptr, 0, 0, 0};
+            const char* type = reinterpret_cast<const char*>(reader.next(stringLengths[2 * t]));
+            const char* path = reinterpret_cast<const char*>(reader.next(stringLengths[2 * t + 1]));
+            if(!reader.ok())
+                break;
+            texture.type.assign(type, stringLengths[2 * t]);
+            texture.path.assign(path, stringLengths[2 * t + 1]);
+            mesh.textures.push_back(texture);
+        }
+        if(!reader.ok())
+            break;
+
+        // the faces are consecutive runs of the indices
+        mesh.faces.resize(info.faceCount);
+        size_t offset = 0;
+        for(quint32 f = 0; f < info.faceCount && offset + faceSizes[f] <= mesh.indices.size(); f++){
+            mesh.faces[f].vertexIndices.assign(mesh.indices.begin() + offset,
+                                               mesh.indices.begin() + offset + faceSizes[f]);
+            offset += faceSizes[f];
+        }
+        if(offset != mesh.indices.size() || !validCachedMesh(mesh)){
+            reader.fail();
+            break;
+        }
+    }
+
+    if(!reader.ok()){
+        meshes.erase(meshes.begin() + first, meshes.end());
+        return false;
+    }
+    return true;
+}
+
+bool writeModelCache(const QByteArray &key, const vector<Mesh> &meshes)
+{
+    if(!QDir().mkpath(modelCacheDirectory()))
+        return false;
+    // written to a temporary file that replaces the entry once complete, so
+    // a reader never sees half of one
+    QSaveFile file(cacheFileName(key));
+    if(!file.open(QIODevice::WriteOnly))
+        return false;
+
+    CacheWriter writer(file);
+    CacheHeader header = makeCacheHeader(static_cast<quint32>(meshes.size()));
+    writer.write(&header, sizeof(header));
+    for(size_t m = 0; m < meshes.size() && writer.ok(); m++){
+        const Mesh& mesh = meshes[m];
+        vector<unsigned int> faceSizes(mesh.faces.size());
+        size_t offset = 0;
+        for(size_t f = 0; f < mesh.faces.size(); f++){
+            const vector<unsigned int>& face = mesh.faces[f].vertexIndices;
+            // only the indices are stored, the faces must be runs of them
+            if(offset + face.size() > mesh.indices.size() ||
+               !std::equal(face.begin(), face.end(), mesh.indices.begin() + offset)){
+                file.cancelWriting();
+                return false;
+            }
+            faceSizes[f] = static_cast<unsigned int>(face.size());
+            offset += face.size();
+        }
+        vector<quint32> stringLengths;
+        for(size_t t = 0; t < mesh.textures.size(); t++){
+            stringLengths.push_back(static_cast<quint32>(mesh.textures[t].type.size()));
+            stringLengths.push_back(static_cast<quint32>(mesh.textures[t].path.size()));
+        }
+
+        CachedMesh info = CachedMesh();
+        info.aabb = mesh.aabb;
+        info.vertexCount = static_cast<quint32>(mesh.vertices.size());
+        info.indexCount = static_cast<quint32>(mesh.indices.size());
+        info.faceCount = static_cast<quint32>(mesh.faces.size());
+        info.triangleCount = static_cast<quint32>(mesh.triangles.size());
+        info.nodeCount = static_cast<quint32>(mesh.bvh.nodes.size());
+        info.wideNodeCount = static_cast<quint32>(mesh.bvh.wideNodes.size());
+        info.blockCount = static_cast<quint32>(mesh.triangleBlocks.size());
+        info.leafBlockSize = mesh.bvh.leafBlockSize;
+        info.textureCount = static_cast<quint32>(mesh.textures.size());
+        writer.write(&info, sizeof(info));
+        writer.writeArray(mesh.vertices);
+        writer.writeArray(mesh.indices);
+        writer.writeArray(faceSizes);
+        writer.writeArray(mesh.triangles);
+        writer.writeArray(mesh.bvh.nodes);
+        writer.writeArray(mesh.bvh.primIndices);
+        writer.writeArray(mesh.bvh.wideNodes);
+        writer.writeArray(mesh.triangleBlocks);
+        writer.writeArray(mesh.leafFirstBlock);
+        writer.writeArray(stringLengths);
+        for(size_t t = 0; t < mesh.textures.size(); t++){
+            writer.write(mesh.textures[t].type.data(), qint64(mesh.textures[t].type.size()));
+            writer.write(mesh.textures[t].path.data(), qint64(mesh.textures[t].path.size()));
+        }
+    }
+
+    if(!writer.ok()){
+        file.cancelWriting();
+        return false;
+    }
+    return file.commit();
+}
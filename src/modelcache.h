@@ -0,0 +1,40 @@
+#ifndef MODELCACHE_H
+#define MODELCACHE_H
+
+#include <QByteArray>
+#include <QString>
+#include <string>
+#include <vector>
+
+#include "mesh.h"
+
+// On-disk cache of imported models, one file per model holding its meshes
+// ready for rendering: vertex attributes, indices, texture references, the
+// triangles in BVH order, the BVH nodes and the SIMD triangle blocks. The
+// arrays are stored as they are in memory, so a cached model is loaded by
+// mapping its file and copying them into the meshes, with no import and no
+// BVH build.
+// An entry is named after the hash of the model file's contents, the
+// material libraries it refers to, the importer flags and the BVH settings,
+// so editing the model or its materials or changing the settings never hits
+// an old entry. Textures are only referenced by path and decoded from their
+// files as usual.
+
+// directory of the cache files, an empty one disables the cache; defaults to
+// "models" in the application's cache location
+void setModelCacheDirectory(const QString& directory);
+QString modelCacheDirectory();
+
+// key of the model file at path and its material libraries imported with
+// importerFlags, empty if the cache is disabled or the file cannot be read
+QByteArray modelCacheKey(const std::string& path, unsigned int importerFlags);
+
+// Appends the meshes of the entry to meshes, returns false and leaves
+// meshes as it was if there is no such entry, it cannot be read or any of
+// its indices is out of range. The textures of the meshes only have their
+// type and path set.
+bool readModelCache(const QByteArray& key, vector<Mesh>& meshes);
+// stores meshes with their BVHs built under key, false on errors
+bool writeModelCache(const QByteArray& key, const vector<Mesh>& meshes);
+
+#endif // MODELCACHE_H
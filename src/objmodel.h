@@ -23,14 +23,29 @@
 #include <iostream>
 #include <map>
 #include <vector>
+#include <memory>
 using namespace std;
 
 #include "model.h"
 #include "mesh.h"
 #include "aabb.h"
+#include "tasksystem.h"
+#include "modelcache.h"
+#include "assetregistry.h"
+
+// pixels of a texture decoded ahead of processNode
+struct DecodedImage {
+    unsigned char* data;
+    int width;
+    int height;
+    int nrComponents;
+};
 
 
-class ObjModel: public Model
+// Geometry and textures of a model file. They are read only once loaded
+// (apart from the GPU copy made on the first draw), so every model placed
+// from the same file shares one asset, see sharedObjModelAsset().
+class ObjModelAsset
 {
 public:
     /*  Model Data */
@@ -39,17 +54,34 @@ public:
     string directory;
     string path;
     bool gammaCorrection;
+    // textures decoded while loading, waiting for the mesh that uses them
+    map<string, DecodedImage> decodedImages;
+    // whether the textures are on the GPU
+    bool texturesUploaded;
+    // bounds of all meshes, in model space
+    AABB aabb;
 
     /*  Functions   */
-    // constructor, expects a filepath to a 3D model.
-    ObjModel(string const &path, bool gamma, QOpenGLFunctions_3_3_Core &core) : gammaCorrection(gamma)
+    // constructor, expects a filepath to a 3D model. Only CPU data is loaded,
+    // so models can be loaded on any thread and ray traced without a GL
+    // context; the GPU copy is made the first time the model is drawn.
+    ObjModelAsset(string const &path, bool gamma) : gammaCorrection(gamma), texturesUploaded(false)
     {
-        type = OBJMODEL;
         this->path = path;
-        loadModel(path, core);
+        loadModel(path);
+    }
+
+    // model made of meshes built in code, e.g. procedural test scenes
+    explicit ObjModelAsset(const vector<Mesh> &meshes) : meshes(meshes), gammaCorrection(false), texturesUploaded(false)
+    {
+        for(size_t i = 0; i < this->meshes.size(); i++)
+            aabb.merge(this->meshes[i].aabb);
+        parallelFor(this->meshes.size(), [this](size_t i){
+            this->meshes[i].buildBVH();
+        });
     }
 
-    ~ObjModel() {
+    ~ObjModelAsset() {
         foreach(Texture texture, textures_loaded){
             stbi_image_free(texture.data);
         }
@@ -58,65 +90,141 @@ public:
     // draws the model, and thus all its meshes
     void Draw(QOpenGLShaderProgram& shader, QOpenGLFunctions_3_3_Core &core)
     {
+        if(!texturesUploaded)
+            uploadTextures(core);
         size_t size = meshes.size();
         for(size_t i = 0; i < size; i++)
             meshes[i].Draw(shader, core);
     }
 
-    bool intersect(Intersection& intersection){
-        // save world coordinate ray
-        Ray orig_ray = intersection.m_ray;
-        intersection.m_ray = orig_ray.transform(modelMatrix.inverted());
-        // init for this model
-        intersection.model_intersected = false;
-        intersection.m_model_t = kRayTMax;
-        // aabb
-        if(!aabb.intersect(intersection)){
-            intersection.m_ray = orig_ray;
-            return false;
-        }
-        size_t size = meshes.size();
-        for(size_t i = 0; i < size; i++){
-            meshes[i].intersect(intersection);
-        }
-        intersection.m_ray = orig_ray;
-        if(intersection.model_intersected) {
-            Point world_intersect = Point(modelMatrix * intersection.m_model_intersect.toQVector3D());
-            float world_t = (world_intersect.m_x - intersection.m_ray.m_origin.m_x) / intersection.m_ray.m_direction.m_x;
-            if(world_t < intersection.m_t){
-                intersection.m_pModel = this;
-                intersection.m_intersect = world_intersect;
-                intersection.m_t = world_t;
-                intersection.m_normal = Vector(modelMatrix * intersection.m_model_normal.toQVector3D()).normalized();
-
-            }
-        }
-        return intersection.model_intersected;
-    }
-
 private:
     /*  Functions   */
     // loads a model with supported ASSIMP extensions from file and stores the resulting meshes in the meshes vector.
-    void loadModel(string const &path, QOpenGLFunctions_3_3_Core &core)
+    void loadModel(string const &path)
     {
+        // retrieve the directory path of the filepath
+        directory = path.substr(0, path.find_last_of('/'));
+
+        // a model seen before is read back from the model cache, meshes,
+        // BVHs and all, without ASSIMP
+        const unsigned int importerFlags = aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_CalcTangentSpace;
+        QByteArray cacheKey = modelCacheKey(path, importerFlags);
+        if(!cacheKey.isEmpty() && readModelCache(cacheKey, meshes))
+        {
+            for(size_t i = 0; i < meshes.size(); i++)
+                aabb.merge(meshes[i].aabb);
+            loadCachedTextures();
+            cout << path << ": " << meshes.size() << " meshes read from the model cache" << endl;
+            return;
+        }
+
         // read file via ASSIMP
         Assimp::Importer importer;
-        const aiScene* scene = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_CalcTangentSpace);
+        const aiScene* scene = importer.ReadFile(path, importerFlags);
         // check for errors
         if(!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) // if is Not Zero
         {
             cout << "ERROR::ASSIMP:: " << importer.GetErrorString() << endl;
             return;
         }
-        // retrieve the directory path of the filepath
-        directory = path.substr(0, path.find_last_of('/'));
 
+        // decode the textures on the thread pool, processNode picks them up
+        decodeTextures(scene);
         // process ASSIMP's root node recursively
-        processNode(scene->mRootNode, scene, core);
+        processNode(scene->mRootNode, scene);
+        freeDecodedImages();
+
+        // build the ray tracing BVH of every mesh in parallel
+        parallelFor(meshes.size(), [this](size_t i){
+            meshes[i].buildBVH();
+        });
+        for(size_t i = 0; i < meshes.size(); i++)
+            cout << path << " mesh " << i << ": " << meshes[i].triangles.size() << " triangles, "
+                 << bvhBuilderName(bvhBuilder()) << " BVH built in " << meshes[i].bvh.buildTime
+                 << " ms, SAH cost " << meshes[i].bvh.sahCost() << endl;
+
+        if(!cacheKey.isEmpty() && !writeModelCache(cacheKey, meshes))
+            cout << "could not write " << path << " to the model cache" << endl;
+    }
+
+    // the cached meshes only know the type and path of their textures,
+    // they are decoded and shared like processMesh does
+    void loadCachedTextures()
+    {
+        vector<string> paths;
+        for(size_t i = 0; i < meshes.size(); i++)
+        {
+            for(size_t j = 0; j < meshes[i].textures.size(); j++)
+            {
+                const string& texturePath = meshes[i].textures[j].path;
+                if(decodedImages.count(texturePath) == 0){
+                    DecodedImage image = {nullptr, 0, 0, 0};
+                    decodedImages[texturePath] = image;
+                    paths.push_back(texturePath);
+                }
+            }
+        }
+        decodeImages(paths);
+        for(size_t i = 0; i < meshes.size(); i++)
+        {
+            vector<Texture> &textures = meshes[i].textures;
+            for(size_t j = 0; j < textures.size(); j++)
+                textures[j] = loadTexture(textures[j].path, textures[j].type);
+        }
+        freeDecodedImages();
+    }
+
+    // images that no mesh ended up using
+    void freeDecodedImages()
+    {
+        for(map<string, DecodedImage>::iterator it = decodedImages.begin(); it != decodedImages.end(); ++it)
+            stbi_image_free(it->second.data);
+        decodedImages.clear();
+    }
+
+    // decodes every texture referenced by the meshes' materials in parallel
+    void decodeTextures(const aiScene *scene)
+    {
+        static const aiTextureType types[] = {aiTextureType_DIFFUSE, aiTextureType_SPECULAR,
+                                              aiTextureType_HEIGHT, aiTextureType_AMBIENT};
+        vector<string> paths;
+        for(unsigned int i = 0; i < scene->mNumMeshes; i++)
+        {
+            aiMaterial* material = scene->mMaterials[scene->mMeshes[i]->mMaterialIndex];
+            for(unsigned int t = 0; t < sizeof(types) / sizeof(types[0]); t++)
+            {
+                for(unsigned int j = 0; j < material->GetTextureCount(types[t]); j++)
+                {
+                    aiString str;
+                    material->GetTexture(types[t], j, &str);
+                    string texturePath = str.C_Str();
+                    if(decodedImages.count(texturePath) == 0){
+                        DecodedImage image = {nullptr, 0, 0, 0};
+                        decodedImages[texturePath] = image;
+                        paths.push_back(texturePath);
+                    }
+                }
+            }
+        }
+
+        decodeImages(paths);
+    }
+
+    // decodes the images at paths, which must have entries in decodedImages, in parallel
+    void decodeImages(const vector<string> &paths)
+    {
+        vector<DecodedImage*> images;
+        for(size_t i = 0; i < paths.size(); i++)
+            images.push_back(&decodedImages[paths[i]]);
+        parallelFor(paths.size(), [&](size_t i){
+            string filename = directory + '/' + paths[i];
+            DecodedImage& image = *images[i];
+            image.data = stbi_load(filename.c_str(), &image.width, &image.height, &image.nrComponents, 0);
+        });
     }
 
     // processes a node in a recursive fashion. Processes each individual mesh located at the node and repeats this process on its children nodes (if any).
-    void processNode(aiNode *node, const aiScene *scene, QOpenGLFunctions_3_3_Core &core)
+    void processNode(aiNode *node, const aiScene *scene)
     {
         // process each mesh located at the current node
         for(unsigned int i = 0; i < node->mNumMeshes; i++)
@@ -124,17 +232,17 @@ private:
             // the node object only contains indices to index the actual objects in the scene.
             // the scene contains all the data, node is just to keep stuff organized (like relations between nodes).
             aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-            meshes.push_back(processMesh(mesh, scene, core));
+            meshes.push_back(processMesh(mesh, scene));
         }
         // after we've processed all of the meshes (if any) we then recursively process each of the children nodes
         for(unsigned int i = 0; i < node->mNumChildren; i++)
         {
-            processNode(node->mChildren[i], scene, core);
+            processNode(node->mChildren[i], scene);
         }
 
     }
 
-    Mesh processMesh(aiMesh *mesh, const aiScene *scene, QOpenGLFunctions_3_3_Core &core)
+    Mesh processMesh(aiMesh *mesh, const aiScene *scene)
     {
         // data to fill
         vector<Vertex> vertices;
@@ -220,100 +328,126 @@ private:
         // normal: texture_normalN
 
         // 1. diffuse maps
-        vector<Texture> diffuseMaps = loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse", core);
+        vector<Texture> diffuseMaps = loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse");
         textures.insert(textures.end(), diffuseMaps.begin(), diffuseMaps.end());
         // 2. specular maps
-        vector<Texture> specularMaps = loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular", core);
+        vector<Texture> specularMaps = loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular");
         textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
         // 3. normal maps
-        std::vector<Texture> normalMaps = loadMaterialTextures(material, aiTextureType_HEIGHT, "texture_normal", core);
+        std::vector<Texture> normalMaps = loadMaterialTextures(material, aiTextureType_HEIGHT, "texture_normal");
         textures.insert(textures.end(), normalMaps.begin(), normalMaps.end());
         // 4. height maps
-        std::vector<Texture> heightMaps = loadMaterialTextures(material, aiTextureType_AMBIENT, "texture_height", core);
+        std::vector<Texture> heightMaps = loadMaterialTextures(material, aiTextureType_AMBIENT, "texture_height");
         textures.insert(textures.end(), heightMaps.begin(), heightMaps.end());
 
         // return a mesh object created from the extracted mesh data
-        return Mesh(vertices, indices, faces, textures, mesh_aabb, core);
+        return Mesh(vertices, indices, faces, textures, mesh_aabb);
     }
 
-    unsigned int TextureFromFile(const char *path, const string &directory, bool gamma, unsigned char* &data, int &width, int &height, int &nrComponents, QOpenGLFunctions_3_3_Core &core)
+    // pixels of a texture, decoded by decodeTextures() if possible
+    void TextureFromFile(const char *path, const string &directory, bool gamma, unsigned char* &data, int &width, int &height, int &nrComponents)
     {
         string filename = string(path);
         filename = directory + '/' + filename;
 
-        unsigned int textureID;
-        core.glGenTextures(1, &textureID);
-
-        data = stbi_load(filename.c_str(), &width, &height, &nrComponents, 0);
-        if (data)
+        map<string, DecodedImage>::iterator decoded = decodedImages.find(string(path));
+        if(decoded != decodedImages.end())
         {
-            GLenum format;
-            if (nrComponents == 1)
-                format = GL_RED;
-            else if (nrComponents == 3)
-                format = GL_RGB;
-            else if (nrComponents == 4)
-                format = GL_RGBA;
-
-            core.glBindTexture(GL_TEXTURE_2D, textureID);
-            core.glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-            core.glGenerateMipmap(GL_TEXTURE_2D);
-
-            core.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-            core.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-            core.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-            core.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-//            stbi_image_free(data);
+            // the texture owns the pixels from now on
+            data = decoded->second.data;
+            width = decoded->second.width;
+            height = decoded->second.height;
+            nrComponents = decoded->second.nrComponents;
+            decodedImages.erase(decoded);
         }
         else
-        {
+            data = stbi_load(filename.c_str(), &width, &height, &nrComponents, 0);
+        if (!data)
             std::cout << "Texture failed to load at path: " << path << std::endl;
-            stbi_image_free(data);
+    }
+
+    // creates the GL textures of the model and hands their ids to the meshes
+    void uploadTextures(QOpenGLFunctions_3_3_Core &core)
+    {
+        map<string, unsigned int> ids;
+        for(size_t i = 0; i < textures_loaded.size(); i++)
+        {
+            Texture &texture = textures_loaded[i];
+            if(texture.data)
+                texture.id = uploadTexture(texture, core);
+            ids[texture.path] = texture.id;
+        }
+        for(size_t i = 0; i < meshes.size(); i++)
+        {
+            vector<Texture> &textures = meshes[i].textures;
+            for(size_t j = 0; j < textures.size(); j++)
+                textures[j].id = ids[textures[j].path];
         }
+        texturesUploaded = true;
+    }
+
+    unsigned int uploadTexture(const Texture &texture, QOpenGLFunctions_3_3_Core &core)
+    {
+        GLenum format;
+        if (texture.nrComponents == 1)
+            format = GL_RED;
+        else if (texture.nrComponents == 3)
+            format = GL_RGB;
+        else if (texture.nrComponents == 4)
+            format = GL_RGBA;
 
+        unsigned int textureID;
+        core.glGenTextures(1, &textureID);
+        core.glBindTexture(GL_TEXTURE_2D, textureID);
+        core.glTexImage2D(GL_TEXTURE_2D, 0, format, texture.width, texture.height, 0, format, GL_UNSIGNED_BYTE, texture.data);
+        core.glGenerateMipmap(GL_TEXTURE_2D);
+
+        core.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        core.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        core.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        core.glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
         return textureID;
     }
 
     // checks all material textures of a given type and loads the textures if they're not loaded yet.
     // the required info is returned as a Texture struct.
-    vector<Texture> loadMaterialTextures(aiMaterial *mat, aiTextureType type, string typeName, QOpenGLFunctions_3_3_Core &core)
+    vector<Texture> loadMaterialTextures(aiMaterial *mat, aiTextureType type, string typeName)
     {
         vector<Texture> textures;
         for(unsigned int i = 0; i < mat->GetTextureCount(type); i++)
         {
             aiString str;
             mat->GetTexture(type, i, &str);
-            // check if texture was loaded before and if so, continue to next iteration: skip loading a new texture
-            bool skip = false;
-            for(unsigned int j = 0; j < textures_loaded.size(); j++)
-            {
-                if(std::strcmp(textures_loaded[j].path.data(), str.C_Str()) == 0)
-                {
-                    textures.push_back(textures_loaded[j]);
-                    skip = true; // a texture with the same filepath has already been loaded, continue to next one. (optimization)
-                    break;
-                }
-            }
-            if(!skip)
-            {   // if texture hasn't been loaded already, load it
-                Texture texture;
-                unsigned char* data;
-                int width, height, nrComponents;
-                texture.id = TextureFromFile(str.C_Str(), this->directory, false, data, width, height, nrComponents, core);
-                texture.type = typeName;
-                texture.path = str.C_Str();
-                texture.data = data;
-                texture.width = width;
-                texture.height = height;
-                texture.nrComponents = nrComponents;
-                textures.push_back(texture);
-                textures_loaded.push_back(texture);  // store it as texture loaded for entire model, to ensure we won't unnecesery load duplicate textures.
-            }
+            textures.push_back(loadTexture(str.C_Str(), typeName));
         }
         return textures;
     }
 
+    // the texture at path, loaded the first time a mesh of the model uses it
+    Texture loadTexture(const string &path, const string &typeName)
+    {
+        // check if texture was loaded before and if so, skip loading a new texture
+        for(unsigned int j = 0; j < textures_loaded.size(); j++)
+        {
+            if(textures_loaded[j].path == path)
+                return textures_loaded[j]; // a texture with the same filepath has already been loaded. (optimization)
+        }
+        // if texture hasn't been loaded already, load it
+        Texture texture;
+        unsigned char* data;
+        int width, height, nrComponents;
+        TextureFromFile(path.c_str(), this->directory, false, data, width, height, nrComponents);
+        texture.id = 0;
+        texture.type = typeName;
+        texture.path = path;
+        texture.data = data;
+        texture.width = width;
+        texture.height = height;
+        texture.nrComponents = nrComponents;
+        textures_loaded.push_back(texture);  // store it as texture loaded for entire model, to ensure we won't unnecesery load duplicate textures.
+        return texture;
+    }
+
     Color sampleFromTexture(Texture &texture, float u, float v)
     {
         float x = (texture.width - 1)* u;
@@ -342,4 +476,86 @@ private:
     }
 };
 
+
+// A model placed in the scene: its own model matrix and Phong parameters
+// over geometry shared with every other model of the same file
+class ObjModel: public Model
+{
+public:
+    std::shared_ptr<ObjModelAsset> asset;
+    // file the model was loaded from, empty for models built in code
+    string path;
+
+    // model of the file at path, sharing the geometry of the models loaded
+    // from it before
+    ObjModel(string const &path, bool gamma) : asset(sharedObjModelAsset(path, gamma)), path(path)
+    {
+        type = OBJMODEL;
+        aabb = asset->aabb;
+    }
+
+    // another instance of the geometry of asset
+    explicit ObjModel(const std::shared_ptr<ObjModelAsset> &asset) : asset(asset), path(asset->path)
+    {
+        type = OBJMODEL;
+        aabb = asset->aabb;
+    }
+
+    // model made of meshes built in code, e.g. procedural test scenes
+    explicit ObjModel(const vector<Mesh> &meshes) : asset(std::make_shared<ObjModelAsset>(meshes))
+    {
+        type = OBJMODEL;
+        aabb = asset->aabb;
+    }
+
+    // draws the model, and thus all its meshes
+    void Draw(QOpenGLShaderProgram& shader, QOpenGLFunctions_3_3_Core &core)
+    {
+        asset->Draw(shader, core);
+    }
+
+    bool intersect(const Ray& ray, Intersection& intersection, TraversalCounts& counts){
+        // t is shared by both spaces, so the closest hit so far bounds the model space ray too
+        Ray modelRay = ray.transform(worldToModel);
+        float tEnter, tExit;
+        if(!aabb.intersect(modelRay, kRayTMin, intersection.m_t, tEnter, tExit))
+            return false;
+        bool hit = false;
+        size_t size = asset->meshes.size();
+        for(size_t i = 0; i < size; i++){
+            if(asset->meshes[i].intersect(modelRay, intersection, counts)){
+                intersection.m_pModel = this;
+                intersection.m_meshIndex = static_cast<unsigned int>(i);
+                hit = true;
+            }
+        }
+        return hit;
+    }
+
+    SurfaceInteraction surfaceInteraction(const Ray& ray, const Intersection& intersection) const{
+        SurfaceInteraction surface;
+        asset->meshes[intersection.m_meshIndex].interpolate(intersection.m_primIndex, intersection.m_u, intersection.m_v,
+                                                     surface.m_normal, surface.m_texU, surface.m_texV);
+        // t is shared by both spaces, so the world position comes straight from the ray
+        surface.m_position = ray.calculate(intersection.m_t);
+        surface.m_normal = toVector(normalize3(toFloat4(normalToWorld.transformVector(surface.m_normal))));
+        surface.m_pModel = intersection.m_pModel;
+        return surface;
+    }
+
+    bool occluded(const Ray& ray, float tMax, TraversalCounts& counts){
+        // t is shared by both spaces, so tMax needs no conversion
+        Ray modelRay = ray.transform(worldToModel);
+        float tEnter, tExit;
+        if(!aabb.intersect(modelRay, 0.0f, tMax, tEnter, tExit))
+            return false;
+        size_t size = asset->meshes.size();
+        for(size_t i = 0; i < size; i++){
+            if(asset->meshes[i].occluded(modelRay, tMax, counts))
+                return true;
+        }
+        return false;
+    }
+};
+
 #endif
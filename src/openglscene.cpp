@@ -217,10 +217,20 @@ void OpenGLScene::paintGL(){
     QVector3D oldCameraPos = camera->position;
 
     camera->processInput(0.5f);//speed
-    foreach(AABB objModelAABB, this->objModelAABBs){
-        if(objModelAABB.pointInAABB(camera->position)) {
-            camera->position = oldCameraPos;
-            break;
+    // test the whole step against the boxes so that fast moves can't pass through thin objects
+    Vector step = Vector(camera->position) - Vector(oldCameraPos);
+    float stepLength = step.length();
+    if(stepLength > 0.0f){
+        Ray stepRay(Point(oldCameraPos), step / stepLength);
+        float tEnter, tExit;
+        foreach(AABB objModelAABB, this->objModelAABBs){
+            // a camera already inside a box may move anywhere, or it could never leave it
+            if(objModelAABB.pointInAABB(oldCameraPos))
+                continue;
+            if(objModelAABB.intersect(stepRay, 0.0f, stepLength, tEnter, tExit)) {
+                camera->position = oldCameraPos;
+                break;
+            }
         }
     }
     emit updateCameraPosition();
@@ -308,13 +318,13 @@ void OpenGLScene::paintGL(){
             QMatrix4x4 view = camera->getViewMatrix();
             shadow_mapping_phong_shader.setUniformValue("view", view);
             // set light uniforms
-            shadow_mapping_phong_shader.setUniformValue("model", model->modelMatrix);
+            shadow_mapping_phong_shader.setUniformValue("model", model->modelMatrix());
             if(model->type == Model::OBJMODEL){
                 ObjModel* objModel = (ObjModel*)model;
                 objModel->Draw(shadow_mapping_phong_shader, *this);
             }
             objModelAABBs[i] = model->aabb;
-            objModelAABBs[i].transform(model->modelMatrix);
+            objModelAABBs[i].transform(model->modelMatrix());
         }
     }
 //    else // point shadow
@@ -364,13 +374,13 @@ void OpenGLScene::paintGL(){
 //            QMatrix4x4 view = camera->getViewMatrix();
 //            point_shadow_phong_shader.setUniformValue("view", view);
 //            // set light uniforms
-//            point_shadow_phong_shader.setUniformValue("model", model->modelMatrix);
+//            point_shadow_phong_shader.setUniformValue("model", model->modelMatrix());
 //            if(model->type == Model::OBJMODEL){
 //                ObjModel* objModel = (ObjModel*)model;
 //                objModel->Draw(point_shadow_phong_shader, *this);
 //            }
 //            objModelAABBs[i] = model->aabb;
-//            objModelAABBs[i].transform(model->modelMatrix);
+//            objModelAABBs[i].transform(model->modelMatrix());
 //        }
 //    }
 }
@@ -505,7 +515,7 @@ void OpenGLScene::renderScene(QOpenGLShaderProgram &shader, bool light)
     for(size_t i=0; i<modelNum; i++){
         Model* model = scene->models[i];
         // set light uniforms
-        shader.setUniformValue("model", model->modelMatrix);
+        shader.setUniformValue("model", model->modelMatrix());
         if(light){
             // light model parameters
             shader.setUniformValue("ambientStrength", model->ka);
@@ -517,7 +527,7 @@ void OpenGLScene::renderScene(QOpenGLShaderProgram &shader, bool light)
             objModel->Draw(shader, *this);
         }
         objModelAABBs[i] = model->aabb;
-        objModelAABBs[i].transform(model->modelMatrix);
+        objModelAABBs[i].transform(model->modelMatrix());
     }
 }
 
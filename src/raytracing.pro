@@ -24,6 +24,9 @@ DEFINES += QT_DEPRECATED_WARNINGS
 
 CONFIG += c++11
 
+# Uncomment to traverse the binary BVH instead of the 4-wide one by default
+#DEFINES += RAYTRACING_BINARY_BVH
+
 SOURCES += \
         main.cpp \
         mainwindow.cpp \
@@ -34,10 +37,17 @@ SOURCES += \
     raytracingscene.cpp \
     scene.cpp \
     aabb.cpp \
+    bvh.cpp \
     camera.cpp \
     locallighting.cpp \
     geometry.cpp \
-    raytracingdialog.cpp
+    raytracingdialog.cpp \
+    triangleblock.cpp \
+    tilescheduler.cpp \
+    tasksystem.cpp \
+    modelcache.cpp \
+    assetregistry.cpp \
+    renderjob.cpp
 
 HEADERS += \
         mainwindow.h \
@@ -49,16 +59,25 @@ HEADERS += \
     stb_image.h \
     mesh.h \
     aabb.h \
+    bvh.h \
     raytracingscene.h \
     objmodel.h \
     model.h \
     cubemodel.h \
     scene.h \
     raytracing/basic.h \
+    raytracing/simd.h \
     light.h \
     locallighting.h \
     geometry.h \
-    raytracingdialog.h
+    raytracingdialog.h \
+    triangleblock.h \
+    tilescheduler.h \
+    tasksystem.h \
+    renderjob.h \
+    renderstats.h \
+    modelcache.h \
+    assetregistry.h
 
 FORMS += \
         mainwindow.ui \
@@ -4,9 +4,11 @@
 #include <cmath>
 #include <algorithm>
 #include <vector>
+#include <type_traits>
 #include <QVector3D>
 #include <QMatrix4x4>
 #include <glm/glm.hpp>
+#include "simd.h"
 
 #ifndef M_PI
     #define M_PI 3.1415926
@@ -16,16 +18,18 @@ struct Color
 {
     float m_r, m_g, m_b;
 
-    Color()                          : m_r(0.0f), m_g(0.0f), m_b(0.0f)    { }
-    Color(const Color& c)            : m_r(c.m_r), m_g(c.m_g), m_b(c.m_b) { }
-    Color(float r, float g, float b) : m_r(r), m_g(g), m_b(b)             { }
-    explicit Color(float f)          : m_r(f), m_g(f), m_b(f)             { }
+    constexpr Color()                          : m_r(0.0f), m_g(0.0f), m_b(0.0f)    { }
+    constexpr Color(float r, float g, float b) : m_r(r), m_g(g), m_b(b)             { }
+    constexpr explicit Color(float f)          : m_r(f), m_g(f), m_b(f)             { }
     Color(QVector3D c)               : m_r(c.x()), m_g(c.y()), m_b(c.z()) {}
 
     QVector3D toQVector3D(){
         return QVector3D(m_r, m_g, m_b);
     }
 
+    float maxComponent() const { return std::max(std::max(m_r, m_g), m_b); }
+    constexpr float luminance() const { return 0.2126f * m_r + 0.7152f * m_g + 0.0722f * m_b; }
+
     void clamp(float min = 0.0f, float max = 1.0f)
     {
         m_r = std::max(min, std::min(max, m_r));
@@ -34,14 +38,6 @@ struct Color
     }
 
 
-    Color& operator =(const Color& c)
-    {
-        m_r = c.m_r;
-        m_g = c.m_g;
-        m_b = c.m_b;
-        return *this;
-    }
-
     Color& operator +=(const Color& c)
     {
         m_r += c.m_r;
@@ -92,7 +88,7 @@ struct Color
 };
 
 
-inline Color operator +(const Color& c1, const Color& c2)
+inline constexpr Color operator +(const Color& c1, const Color& c2)
 {
     return Color(c1.m_r + c2.m_r,
                  c1.m_g + c2.m_g,
@@ -100,7 +96,7 @@ inline Color operator +(const Color& c1, const Color& c2)
 }
 
 
-inline Color operator -(const Color& c1, const Color& c2)
+inline constexpr Color operator -(const Color& c1, const Color& c2)
 {
     return Color(c1.m_r - c2.m_r,
                  c1.m_g - c2.m_g,
@@ -108,7 +104,7 @@ inline Color operator -(const Color& c1, const Color& c2)
 }
 
 
-inline Color operator *(const Color& c1, const Color& c2)
+inline constexpr Color operator *(const Color& c1, const Color& c2)
 {
     return Color(c1.m_r * c2.m_r,
                  c1.m_g * c2.m_g,
@@ -116,7 +112,7 @@ inline Color operator *(const Color& c1, const Color& c2)
 }
 
 
-inline Color operator /(const Color& c1, const Color& c2)
+inline constexpr Color operator /(const Color& c1, const Color& c2)
 {
     return Color(c1.m_r / c2.m_r,
                  c1.m_g / c2.m_g,
@@ -124,7 +120,7 @@ inline Color operator /(const Color& c1, const Color& c2)
 }
 
 
-inline Color operator *(const Color& c, float f)
+inline constexpr Color operator *(const Color& c, float f)
 {
     return Color(f * c.m_r,
                  f * c.m_g,
@@ -132,7 +128,7 @@ inline Color operator *(const Color& c, float f)
 }
 
 
-inline Color operator *(float f, const Color& c)
+inline constexpr Color operator *(float f, const Color& c)
 {
     return Color(f * c.m_r,
                  f * c.m_g,
@@ -140,7 +136,7 @@ inline Color operator *(float f, const Color& c)
 }
 
 
-inline Color operator /(const Color& c, float f)
+inline constexpr Color operator /(const Color& c, float f)
 {
     return Color(c.m_r / f,
                  c.m_g / f,
@@ -164,10 +160,9 @@ struct Vector
 {
     float m_x, m_y, m_z;
 
-    Vector()                          : m_x(0.0f), m_y(0.0f), m_z(0.0f)    { }
-    Vector(const Vector& v)           : m_x(v.m_x), m_y(v.m_y), m_z(v.m_z) { }
-    Vector(float x, float y, float z) : m_x(x), m_y(y), m_z(z)             { }
-    explicit Vector(float f)          : m_x(f), m_y(f), m_z(f)             { }
+    constexpr Vector()                          : m_x(0.0f), m_y(0.0f), m_z(0.0f)    { }
+    constexpr Vector(float x, float y, float z) : m_x(x), m_y(y), m_z(z)             { }
+    constexpr explicit Vector(float f)          : m_x(f), m_y(f), m_z(f)             { }
     Vector(QVector3D v)               : m_x(v.x()), m_y(v.y()), m_z(v.z()) { }
     Vector(glm::vec3 v)               : m_x(v.x), m_y(v.y), m_z(v.z)       { }
 
@@ -175,7 +170,7 @@ struct Vector
         return QVector3D(m_x, m_y, m_z);
     }
 
-    float length2() const { return m_x * m_x + m_y * m_y + m_z * m_z; }
+    constexpr float length2() const { return m_x * m_x + m_y * m_y + m_z * m_z; }
     float length()  const { return std::sqrt(length2()); }
 
     // Returns old length from before normalization (ignore the return value if you don't need it)
@@ -187,14 +182,6 @@ struct Vector
     float minComponent() const { return std::min(std::min(m_x, m_y), m_z); }
 
 
-    Vector& operator =(const Vector& v)
-    {
-        m_x = v.m_x;
-        m_y = v.m_y;
-        m_z = v.m_z;
-        return *this;
-    }
-
     Vector& operator +=(const Vector& v)
     {
         m_x += v.m_x;
@@ -243,7 +230,7 @@ struct Vector
         return *this;
     }
 
-    Vector operator -() const
+    constexpr Vector operator -() const
     {
         return Vector(-m_x, -m_y, -m_z);
     }
@@ -257,7 +244,7 @@ struct Vector
 };
 
 
-inline Vector operator +(const Vector& v1, const Vector& v2)
+inline constexpr Vector operator +(const Vector& v1, const Vector& v2)
 {
     return Vector(v1.m_x + v2.m_x,
                   v1.m_y + v2.m_y,
@@ -265,7 +252,7 @@ inline Vector operator +(const Vector& v1, const Vector& v2)
 }
 
 
-inline Vector operator -(const Vector& v1, const Vector& v2)
+inline constexpr Vector operator -(const Vector& v1, const Vector& v2)
 {
     return Vector(v1.m_x - v2.m_x,
                   v1.m_y - v2.m_y,
@@ -273,7 +260,7 @@ inline Vector operator -(const Vector& v1, const Vector& v2)
 }
 
 
-inline Vector operator *(const Vector& v1, const Vector& v2)
+inline constexpr Vector operator *(const Vector& v1, const Vector& v2)
 {
     return Vector(v1.m_x * v2.m_x,
                   v1.m_y * v2.m_y,
@@ -281,7 +268,7 @@ inline Vector operator *(const Vector& v1, const Vector& v2)
 }
 
 
-inline Vector operator *(const Vector& v, float f)
+inline constexpr Vector operator *(const Vector& v, float f)
 {
     return Vector(f * v.m_x,
                   f * v.m_y,
@@ -289,7 +276,7 @@ inline Vector operator *(const Vector& v, float f)
 }
 
 
-inline Vector operator *(float f, const Vector& v)
+inline constexpr Vector operator *(float f, const Vector& v)
 {
     return Vector(f * v.m_x,
                   f * v.m_y,
@@ -297,7 +284,7 @@ inline Vector operator *(float f, const Vector& v)
 }
 
 
-inline Vector operator /(const Vector& v1, const Vector& v2)
+inline constexpr Vector operator /(const Vector& v1, const Vector& v2)
 {
     return Vector(v1.m_x / v2.m_x,
                   v1.m_y / v2.m_y,
@@ -305,7 +292,7 @@ inline Vector operator /(const Vector& v1, const Vector& v2)
 }
 
 
-inline Vector operator /(float f, const Vector& v)
+inline constexpr Vector operator /(float f, const Vector& v)
 {
     return Vector(f / v.m_x,
                   f / v.m_y,
@@ -313,7 +300,7 @@ inline Vector operator /(float f, const Vector& v)
 }
 
 
-inline Vector operator /(const Vector& v, float f)
+inline constexpr Vector operator /(const Vector& v, float f)
 {
     return Vector(v.m_x / f,
                   v.m_y / f,
@@ -322,7 +309,7 @@ inline Vector operator /(const Vector& v, float f)
 
 
 // dot(v1, v2) = length(v1) * length(v2) * cos(angle between v1, v2)
-inline float dot(const Vector& v1, const Vector& v2)
+inline constexpr float dot(const Vector& v1, const Vector& v2)
 {
     // In cartesian coordinates, it simplifies to this simple calculation:
     return v1.m_x * v2.m_x + v1.m_y * v2.m_y + v1.m_z * v2.m_z;
@@ -331,7 +318,7 @@ inline float dot(const Vector& v1, const Vector& v2)
 
 // cross(v1, v2) = length(v1) * length(v2) * sin(angle between v1, v2);
 // result is perpendicular to both v1, v2.
-inline Vector cross(const Vector& v1, const Vector& v2)
+inline constexpr Vector cross(const Vector& v1, const Vector& v2)
 {
     // In cartesian coordinates, it simplifies down to this calculation:
     return Vector(v1.m_y * v2.m_z - v1.m_z * v2.m_y,
@@ -340,39 +327,100 @@ inline Vector cross(const Vector& v1, const Vector& v2)
 }
 
 
-inline Vector max(const Vector& v1, const Vector& v2)
+// std::max/min are not constexpr before C++14
+inline constexpr Vector max(const Vector& v1, const Vector& v2)
 {
-    return Vector(std::max(v1.m_x, v2.m_x),
-                  std::max(v1.m_y, v2.m_y),
-                  std::max(v1.m_z, v2.m_z));
+    return Vector(v1.m_x < v2.m_x ? v2.m_x : v1.m_x,
+                  v1.m_y < v2.m_y ? v2.m_y : v1.m_y,
+                  v1.m_z < v2.m_z ? v2.m_z : v1.m_z);
 }
 
-inline Vector min(const Vector& v1, const Vector& v2)
+inline constexpr Vector min(const Vector& v1, const Vector& v2)
 {
-    return Vector(std::min(v1.m_x, v2.m_x),
-                  std::min(v1.m_y, v2.m_y),
-                  std::min(v1.m_z, v2.m_z));
+    return Vector(v2.m_x < v1.m_x ? v2.m_x : v1.m_x,
+                  v2.m_y < v1.m_y ? v2.m_y : v1.m_y,
+                  v2.m_z < v1.m_z ? v2.m_z : v1.m_z);
 }
 
+typedef Vector Point;
+
+// between the packed 3D storage and the SIMD registers
+inline Float4 toFloat4(const Vector& v) { return Float4::load3(&v.m_x); }
+inline Vector toVector(const Float4& f) { Vector v; f.store3(&v.m_x); return v; }
+
+// direction mirrored about normal, normalized
 inline Vector reflect(const Vector& direction, const Vector& normal)
 {
-    Vector view = -direction;
-    Vector reflection = 2.0*normal*dot(normal, view)-view;
-    return reflection.normalized();
+    return toVector(normalize3(reflect3(toFloat4(direction), toFloat4(normal))));
 }
 
-typedef Vector Point;
+
+//
+// Affine transform stored as the columns of the top three rows of a 4x4
+// matrix, each padded to four floats so it loads straight into a Float4
+//
+
+struct Matrix3x4
+{
+    float c[4][4];
+
+    Matrix3x4()
+    {
+        for (int col = 0; col < 4; ++col)
+            for (int r = 0; r < 4; ++r)
+                c[col][r] = (r == col && r < 3) ? 1.0f : 0.0f;
+    }
+
+    explicit Matrix3x4(const QMatrix4x4& matrix)
+    {
+        for (int col = 0; col < 4; ++col)
+        {
+            for (int r = 0; r < 3; ++r)
+                c[col][r] = matrix(r, col);
+            c[col][3] = 0.0f;
+        }
+    }
+
+    Float4 column(int col) const { return Float4::load4(c[col]); }
+
+    Point transformPoint(const Point& p) const
+    {
+        return toVector(column(0) * Float4(p.m_x) + column(1) * Float4(p.m_y) +
+                        column(2) * Float4(p.m_z) + column(3));
+    }
+
+    Vector transformVector(const Vector& v) const
+    {
+        return toVector(column(0) * Float4(v.m_x) + column(1) * Float4(v.m_y) +
+                        column(2) * Float4(v.m_z));
+    }
+};
 
 
 const float kRayTMin = 0.0001f;
 const float kRayTMax = 1.0e30f;
 
+// A hit point is off the surface by a rounding error that grows with the
+// distance the ray travelled to it. Rays leaving the surface start this much
+// of that distance away from it, on the side of their direction.
+const float kRayOffsetScale = 0.0001f;
+
+inline Point offsetRayOrigin(const Point& position, const Vector& normal,
+                             const Vector& direction, float distance)
+{
+    float offset = kRayOffsetScale * std::max(distance, 1.0f);
+    return position + normal * (dot(normal, direction) < 0.0f ? -offset : offset);
+}
+
 struct Ray
 {
     Point m_origin;
     Vector m_direction;
     float m_tMax;
     float m_time;
+    // reciprocal direction for slab tests, call precompute() after changing
+    // m_direction
+    Vector m_invDirection;
 
     // Some sane defaults
     Ray()
@@ -381,141 +429,84 @@ struct Ray
           m_tMax(kRayTMax),
           m_time(0.0f)
     {
-
-    }
-
-    Ray(const Ray& r)
-        : m_origin(r.m_origin),
-          m_direction(r.m_direction),
-          m_tMax(r.m_tMax),
-          m_time(r.m_time)
-    {
-
+        precompute();
     }
 
+    // The direction is taken as it is; t counts in units of its length, so
+    // pass a normalized one where t is meant as a distance.
     Ray(const Point& origin, const Vector& direction, float tMax = kRayTMax, float time = 0.0f)
         : m_origin(origin),
-          m_direction(direction.normalized()),
+          m_direction(direction),
           m_tMax(tMax),
           m_time(time)
     {
-
+        precompute();
     }
 
-    Ray& operator =(const Ray& r)
+    void precompute()
     {
-        m_origin = r.m_origin;
-        m_direction = r.m_direction;
-        m_tMax = r.m_tMax;
-        m_time = r.m_time;
-        return *this;
+        m_invDirection = toVector(Float4(1.0f) / toFloat4(m_direction));
     }
 
     Point calculate(float t) const { return m_origin + t * m_direction; }
 
-    Ray transform(QMatrix4x4 matrix){
-        QVector3D orig_point1 = m_origin.toQVector3D();
-        Point tmp_orig_point2 = m_origin+m_direction;
-        QVector3D orig_point2 = tmp_orig_point2.toQVector3D();
-        QVector3D transformed_point1 = matrix * orig_point1;
-        QVector3D transformed_point2 = matrix * orig_point2;
-        QVector3D transformed_direction = transformed_point2-transformed_point1;
-        return Ray(Point(transformed_point1),
-                   Vector(transformed_direction.normalized()),
-                   m_tMax,
-                   m_time);
+    // The direction is transformed but not renormalized, so a distance t
+    // along the transformed ray is the same point as t along this one.
+    Ray transform(const Matrix3x4& matrix) const
+    {
+        Ray r;
+        r.m_origin = matrix.transformPoint(m_origin);
+        r.m_direction = matrix.transformVector(m_direction);
+        r.m_tMax = m_tMax;
+        r.m_time = m_time;
+        r.precompute();
+        return r;
     }
 };
 
+// copied around by value in the hot loops and stored in flat buffers
+static_assert(std::is_trivially_copyable<Color>::value, "Color must stay trivially copyable");
+static_assert(std::is_trivially_copyable<Vector>::value, "Vector must stay trivially copyable");
+static_assert(std::is_trivially_copyable<Matrix3x4>::value, "Matrix3x4 must stay trivially copyable");
+static_assert(std::is_trivially_copyable<Ray>::value, "Ray must stay trivially copyable");
+
 class Model;
-class Light;
 
+// Closest hit found by Scene::intersect. It only keeps what is needed to find
+// the surface again, the shading attributes are computed from it once the
+// traversal is over.
 struct Intersection
 {
-    Ray m_ray;
-    float m_t; // world coordinate
-    float m_model_t; // model coordinate
-    Model *m_pModel;
-    Color m_colorModifier;
-    Point m_intersect;
-    Point m_model_intersect; // for this model
-    Vector m_normal;
-    Vector m_model_normal;
-    bool intersected;
-    bool model_intersected;
-    std::vector<Light*> lights; // all light sources
+    float m_t;                // distance along the ray, the same in world and model space
+    Model *m_pModel;          // instance that was hit, nullptr if none
+    unsigned int m_meshIndex; // mesh of the instance
+    unsigned int m_primIndex; // triangle of the mesh
+    float m_u, m_v;           // barycentric weights of vertex 1 and vertex 2
 
     Intersection()
-        : m_ray(),
-          m_t(kRayTMax),
-          m_model_t(kRayTMax),
+        : m_t(kRayTMax),
           m_pModel(nullptr),
-          m_colorModifier(1.0f, 1.0f, 1.0f),
-          m_intersect(),
-          m_model_intersect(),
-          m_normal(),
-          m_model_normal(),
-          intersected(false),
-          model_intersected(false),
-          lights()
-    {
-
-    }
-
-    Intersection(const Intersection& i)
-        : m_ray(i.m_ray),
-          m_t(i.m_t),
-          m_model_t(i.m_model_t),
-          m_pModel(i.m_pModel),
-          m_colorModifier(i.m_colorModifier),
-          m_intersect(i.m_intersect),
-          m_model_intersect(i.m_model_intersect),
-          m_normal(i.m_normal),
-          m_model_normal(i.m_model_normal),
-          intersected(false),
-          model_intersected(false),
-          lights(i.lights)
+          m_meshIndex(0),
+          m_primIndex(0),
+          m_u(0.0f),
+          m_v(0.0f)
     {
 
     }
 
-    Intersection(const Ray& ray)
-         : m_ray(ray),
-           m_t(ray.m_tMax),
-           m_model_t(ray.m_tMax),
-           m_pModel(nullptr),
-           m_colorModifier(1.0f, 1.0f, 1.0f),
-           m_intersect(),
-           m_model_intersect(),
-           m_normal(),
-           m_model_normal(),
-           intersected(false),
-           model_intersected(false),
-           lights()
-    {
-
-    }
+    bool hit() const { return m_pModel != nullptr; }
+};
 
-    Intersection& operator =(const Intersection& i)
-    {
-        m_ray = i.m_ray;
-        m_t = i.m_t;
-        m_model_t = i.m_model_t;
-        m_pModel = i.m_pModel;
-        m_colorModifier = i.m_colorModifier;
-        m_intersect = i.m_intersect;
-        m_model_intersect = i.m_model_intersect;
-        m_normal = i.m_normal;
-        m_model_normal = i.m_model_normal;
-        lights = i.lights;
-        intersected = i.intersected;
-        model_intersected = i.model_intersected;
-        return *this;
-    }
+// Shading attributes of a hit, reconstructed from the Intersection by
+// Model::surfaceInteraction() once the closest hit is known
+struct SurfaceInteraction
+{
+    Point m_position;     // world space
+    Vector m_normal;      // world space shading normal, normalized
+    float m_texU, m_texV; // texture coordinates
+    Model *m_pModel;
 
-    Point model_intersect(float t){
-        return m_ray.m_origin + t * m_ray.m_direction;
-    }
+    SurfaceInteraction() : m_texU(0.0f), m_texV(0.0f), m_pModel(nullptr) { }
 };
 
 #endif // RAYTRACING_H
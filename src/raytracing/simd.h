@@ -0,0 +1,194 @@
+#ifndef RAYTRACING_SIMD_H
+#define RAYTRACING_SIMD_H
+
+#include <cmath>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    #define RAYTRACING_SSE
+    #include <xmmintrin.h>
+#endif
+
+//
+// Four floats in one SSE register (a plain array on other CPUs), for the
+// arithmetic of the hot paths. The 3D types keep their packed three float
+// storage, which is what the BVH nodes and vertex arrays are made of; they
+// are loaded into a Float4 where several components are worked on at once.
+// A 3D value has 0 in the fourth lane, the *3 functions ignore that lane.
+//
+
+struct Float4
+{
+#ifdef RAYTRACING_SSE
+    __m128 v;
+
+    Float4() { }
+    Float4(__m128 m) : v(m) { }
+    explicit Float4(float f) : v(_mm_set1_ps(f)) { }
+    Float4(float x, float y, float z, float w) : v(_mm_setr_ps(x, y, z, w)) { }
+
+    // p[0..3], p needs no alignment
+    static Float4 load4(const float* p) { return _mm_loadu_ps(p); }
+    // p[0..2] with w = 0, reads nothing past p[2]
+    static Float4 load3(const float* p) { return _mm_setr_ps(p[0], p[1], p[2], 0.0f); }
+    void store4(float* p) const { _mm_storeu_ps(p, v); }
+    void store3(float* p) const
+    {
+        p[0] = _mm_cvtss_f32(v);
+        p[1] = _mm_cvtss_f32(_mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1)));
+        p[2] = _mm_cvtss_f32(_mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2)));
+    }
+
+    float x() const { return _mm_cvtss_f32(v); }
+#else
+    float v[4];
+
+    Float4() { }
+    explicit Float4(float f) { v[0] = v[1] = v[2] = v[3] = f; }
+    Float4(float x, float y, float z, float w) { v[0] = x; v[1] = y; v[2] = z; v[3] = w; }
+
+    static Float4 load4(const float* p) { return Float4(p[0], p[1], p[2], p[3]); }
+    static Float4 load3(const float* p) { return Float4(p[0], p[1], p[2], 0.0f); }
+    void store4(float* p) const { p[0] = v[0]; p[1] = v[1]; p[2] = v[2]; p[3] = v[3]; }
+    void store3(float* p) const { p[0] = v[0]; p[1] = v[1]; p[2] = v[2]; }
+
+    float x() const { return v[0]; }
+#endif
+};
+
+#ifdef RAYTRACING_SSE
+
+inline Float4 operator +(const Float4& a, const Float4& b) { return _mm_add_ps(a.v, b.v); }
+inline Float4 operator -(const Float4& a, const Float4& b) { return _mm_sub_ps(a.v, b.v); }
+inline Float4 operator *(const Float4& a, const Float4& b) { return _mm_mul_ps(a.v, b.v); }
+inline Float4 operator /(const Float4& a, const Float4& b) { return _mm_div_ps(a.v, b.v); }
+// like std::min/max: b is returned where either lane is NaN
+inline Float4 min(const Float4& a, const Float4& b) { return _mm_min_ps(a.v, b.v); }
+inline Float4 max(const Float4& a, const Float4& b) { return _mm_max_ps(a.v, b.v); }
+// mask of the lanes where a or b is NaN
+inline Float4 unordered(const Float4& a, const Float4& b) { return _mm_cmpunord_ps(a.v, b.v); }
+// mask of the lanes where a <= b
+inline Float4 lessEqual(const Float4& a, const Float4& b) { return _mm_cmple_ps(a.v, b.v); }
+// a where the mask is set, b elsewhere
+inline Float4 select(const Float4& mask, const Float4& a, const Float4& b)
+{
+    return _mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v));
+}
+// bit i set if lane i of the mask is
+inline int moveMask(const Float4& mask) { return _mm_movemask_ps(mask.v); }
+
+inline float minComponent3(const Float4& a)
+{
+    __m128 m = _mm_min_ss(a.v, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(_mm_min_ss(m, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(2, 2, 2, 2))));
+}
+
+inline float maxComponent3(const Float4& a)
+{
+    __m128 m = _mm_max_ss(a.v, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(_mm_max_ss(m, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(2, 2, 2, 2))));
+}
+
+inline float dot3(const Float4& a, const Float4& b)
+{
+    __m128 p = _mm_mul_ps(a.v, b.v);
+    __m128 s = _mm_add_ss(p, _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 2, 2))));
+}
+
+inline Float4 cross3(const Float4& a, const Float4& b)
+{
+    // a * b.yzx - a.yzx * b, which comes out as the cross product in yzx order
+    __m128 aYzx = _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 bYzx = _mm_shuffle_ps(b.v, b.v, _MM_SHUFFLE(3, 0, 2, 1));
+    __m128 c = _mm_sub_ps(_mm_mul_ps(a.v, bYzx), _mm_mul_ps(aYzx, b.v));
+    return _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 0, 2, 1));
+}
+
+#else
+
+inline Float4 operator +(const Float4& a, const Float4& b) { return Float4(a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3]); }
+inline Float4 operator -(const Float4& a, const Float4& b) { return Float4(a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2], a.v[3] - b.v[3]); }
+inline Float4 operator *(const Float4& a, const Float4& b) { return Float4(a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3]); }
+inline Float4 operator /(const Float4& a, const Float4& b) { return Float4(a.v[0] / b.v[0], a.v[1] / b.v[1], a.v[2] / b.v[2], a.v[3] / b.v[3]); }
+
+inline Float4 min(const Float4& a, const Float4& b)
+{
+    Float4 r;
+    for (int i = 0; i < 4; ++i)
+        r.v[i] = a.v[i] < b.v[i] ? a.v[i] : b.v[i];
+    return r;
+}
+
+inline Float4 max(const Float4& a, const Float4& b)
+{
+    Float4 r;
+    for (int i = 0; i < 4; ++i)
+        r.v[i] = a.v[i] > b.v[i] ? a.v[i] : b.v[i];
+    return r;
+}
+
+// masks hold 1 in the set lanes
+inline Float4 unordered(const Float4& a, const Float4& b)
+{
+    Float4 r;
+    for (int i = 0; i < 4; ++i)
+        r.v[i] = (std::isnan(a.v[i]) || std::isnan(b.v[i])) ? 1.0f : 0.0f;
+    return r;
+}
+
+inline Float4 lessEqual(const Float4& a, const Float4& b)
+{
+    Float4 r;
+    for (int i = 0; i < 4; ++i)
+        r.v[i] = a.v[i] <= b.v[i] ? 1.0f : 0.0f;
+    return r;
+}
+
+inline Float4 select(const Float4& mask, const Float4& a, const Float4& b)
+{
+    Float4 r;
+    for (int i = 0; i < 4; ++i)
+        r.v[i] = mask.v[i] != 0.0f ? a.v[i] : b.v[i];
+    return r;
+}
+
+inline int moveMask(const Float4& mask)
+{
+    int bits = 0;
+    for (int i = 0; i < 4; ++i)
+        bits |= (mask.v[i] != 0.0f) << i;
+    return bits;
+}
+
+inline float minComponent3(const Float4& a) { return std::min(std::min(a.v[0], a.v[1]), a.v[2]); }
+inline float maxComponent3(const Float4& a) { return std::max(std::max(a.v[0], a.v[1]), a.v[2]); }
+
+inline float dot3(const Float4& a, const Float4& b)
+{
+    return a.v[0] * b.v[0] + a.v[1] * b.v[1] + a.v[2] * b.v[2];
+}
+
+inline Float4 cross3(const Float4& a, const Float4& b)
+{
+    return Float4(a.v[1] * b.v[2] - a.v[2] * b.v[1],
+                  a.v[2] * b.v[0] - a.v[0] * b.v[2],
+                  a.v[0] * b.v[1] - a.v[1] * b.v[0],
+                  0.0f);
+}
+
+#endif
+
+inline Float4 normalize3(const Float4& a)
+{
+    float length = std::sqrt(dot3(a, a));
+    return length > 0.0f ? a / Float4(length) : a;
+}
+
+// direction mirrored about normal, both 3D
+inline Float4 reflect3(const Float4& direction, const Float4& normal)
+{
+    return direction - normal * Float4(2.0f * dot3(normal, direction));
+}
+
+#endif // RAYTRACING_SIMD_H
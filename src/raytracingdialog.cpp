@@ -1,28 +1,61 @@
 #include "raytracingdialog.h"
 #include "ui_raytracingdialog.h"
 #include "raytracingscene.h"
+#include "renderjob.h"
 #include <QFileDialog>
+#include <QFileInfo>
+#include <QJsonDocument>
 #include <QMessageBox>
 #include <QDebug>
 
 RayTracingDialog::RayTracingDialog(Scene *scene, PerspectiveCamera *camera, QWidget *parent) :
     scene(scene), camera(camera), QDialog(parent),
-    ui(new Ui::RayTracingDialog)
+    ui(new Ui::RayTracingDialog), job(nullptr)
 {
     ui->setupUi(this);
     ui->widthSpinBox->setRange(100, 1000);
     ui->widthSpinBox->setValue(1200);
     ui->heightSpinBox->setRange(80, 800);
     ui->heightSpinBox->setValue(800);
-    ui->depthSpinBox->setMinimum(1);
+    ui->depthSpinBox->setRange(1, kMaxRayDepth);
     ui->depthSpinBox->setValue(3);
+    // reflection and transmission rays weighing less than this in the pixel are dropped
+    ui->thresholdSpinBox->setDecimals(3);
+    ui->thresholdSpinBox->setRange(0.0, 1.0);
+    ui->thresholdSpinBox->setSingleStep(0.005);
+    ui->thresholdSpinBox->setValue(RenderSettings().minThroughput);
+    // adaptive antialiasing: extra samples only go to pixels whose samples disagree
+    ui->minSamplesSpinBox->setRange(1, 64);
+    ui->minSamplesSpinBox->setValue(RenderSettings().minSamples);
+    ui->maxSamplesSpinBox->setRange(1, 256);
+    ui->maxSamplesSpinBox->setValue(RenderSettings().maxSamples);
+    ui->noiseSpinBox->setDecimals(3);
+    ui->noiseSpinBox->setRange(0.0, 1.0);
+    ui->noiseSpinBox->setSingleStep(0.005);
+    ui->noiseSpinBox->setValue(RenderSettings().noiseThreshold);
+    // heatmaps show what each pixel cost instead of its color, in RenderOutput order
+    ui->outputComboBox->addItem(tr("着色结果"));
+    ui->outputComboBox->addItem(tr("热力图：BVH遍历节点"));
+    ui->outputComboBox->addItem(tr("热力图：三角形测试"));
+    ui->outputComboBox->addItem(tr("热力图：渲染耗时"));
+    setRendering(false);
 }
 
 RayTracingDialog::~RayTracingDialog()
 {
+    delete job;
     delete ui;
 }
 
+void RayTracingDialog::reject()
+{
+    // the job waits for its render threads to stop
+    delete job;
+    job = nullptr;
+    setRendering(false);
+    QDialog::reject();
+}
+
 void RayTracingDialog::on_buttonBox_accepted()
 {
     QString path = ui->fileLineEdit->text();
@@ -31,32 +64,23 @@ void RayTracingDialog::on_buttonBox_accepted()
                              QMessageBox::Ok);
     }
     else{
-        Image* pImage = renderRayTracing(*scene, *camera, ui->widthSpinBox->value(), ui->heightSpinBox->value(), ui->depthSpinBox->value());
-        uchar *argbPixels = new uchar[pImage->width() * pImage->height() * 4];
-        for (size_t y = 0; y < pImage->height(); ++y)
-        {
-            for (size_t x = 0; x < pImage->width(); ++x)
-            {
-                size_t pixelOffset = (y * pImage->width() + x) * 4;
-                Color color = pImage->pixel(x, y);
-                color.clamp();
-                // Stuff actual 32-bit ARGB pixel data in
-                argbPixels[pixelOffset + 3] = 0xFF;
-                argbPixels[pixelOffset + 2] = static_cast<uchar>(color.m_r * 255.0f);
-                argbPixels[pixelOffset + 1] = static_cast<uchar>(color.m_g * 255.0f);
-                argbPixels[pixelOffset + 0] = static_cast<uchar>(color.m_b * 255.0f);
-            }
-        }
-
-        QImage image(argbPixels,
-                     static_cast<int>(pImage->width()),
-                     static_cast<int>(pImage->height()),
-                     QImage::Format_ARGB32_Premultiplied);
-
-        image.save(path);
-        delete pImage;
-        delete[] argbPixels;
-        QMessageBox::information(this, "information", tr("渲染完成"));
+        RenderSettings settings;
+        settings.maxRayDepth = ui->depthSpinBox->value();
+        settings.minThroughput = float(ui->thresholdSpinBox->value());
+        settings.minSamples = ui->minSamplesSpinBox->value();
+        settings.maxSamples = ui->maxSamplesSpinBox->value();
+        settings.noiseThreshold = float(ui->noiseSpinBox->value());
+        settings.output = static_cast<RenderOutput>(ui->outputComboBox->currentIndex());
+        // render on the pool, the previews come back through queued signals
+        savePath = path;
+        job = new RenderJob(*scene, *camera, ui->widthSpinBox->value(), ui->heightSpinBox->value(), settings);
+        connect(job, &RenderJob::previewUpdated, this, &RayTracingDialog::showPreview);
+        connect(job, &RenderJob::progressChanged, ui->progressBar, &QProgressBar::setValue);
+        connect(job, &RenderJob::finished, this, &RayTracingDialog::renderFinished);
+        ui->progressBar->setValue(0);
+        ui->statsLabel->clear();
+        setRendering(true);
+        job->start();
     }
 }
 
@@ -66,3 +90,95 @@ void RayTracingDialog::on_pushButton_clicked()
     QString str = fileDialog.getSaveFileName(this,tr("Save Image"),"raytracing_result",tr("Image File(*.png)"));
     ui->fileLineEdit->setText(str);
 }
+
+void RayTracingDialog::on_pauseButton_clicked()
+{
+    if(!job)
+        return;
+    job->setPaused(!job->isPaused());
+    ui->pauseButton->setText(job->isPaused() ? tr("继续") : tr("暂停"));
+}
+
+void RayTracingDialog::on_stopButton_clicked()
+{
+    if(job)
+        job->cancel();
+}
+
+void RayTracingDialog::showPreview(const QImage &image)
+{
+    ui->previewLabel->setPixmap(QPixmap::fromImage(image.scaled(ui->previewLabel->size(),
+                                                                Qt::KeepAspectRatio,
+                                                                Qt::SmoothTransformation)));
+}
+
+void RayTracingDialog::renderFinished(const QImage &image, bool cancelled)
+{
+    // the signal may still be queued after the job was deleted by reject()
+    if(!job || sender() != job)
+        return;
+    RenderStats stats = job->stats();
+    job->deleteLater();
+    job = nullptr;
+    setRendering(false);
+    if(cancelled)
+        return;
+    showPreview(image);
+    showStats(stats);
+    image.save(savePath);
+    if(ui->statsCheckBox->isChecked() && !saveStats(stats, savePath)){
+        QMessageBox::warning(this, tr("warning"), tr("渲染统计保存失败！"), QMessageBox::Ok);
+    }
+    QMessageBox::information(this, "information", tr("渲染完成"));
+}
+
+void RayTracingDialog::showStats(const RenderStats &stats)
+{
+    double meanTileTime = stats.tiles > 0 ? stats.tileTime * 1e-6 / stats.tiles : 0.0;
+    ui->statsLabel->setText(tr("用时 %1 s，主光线 %2，次级光线 %3，阴影光线 %4\n"
+                               "包围盒测试 %5，三角形测试 %6，BVH节点 %7\n"
+                               "%8 个图块，平均 %9 ms，最长 %10 ms")
+                            .arg(stats.renderTime * 1e-9, 0, 'f', 2)
+                            .arg(stats.primaryRays)
+                            .arg(stats.secondaryRays)
+                            .arg(stats.shadowRays)
+                            .arg(stats.aabbTests)
+                            .arg(stats.triangleTests)
+                            .arg(stats.nodesVisited)
+                            .arg(stats.tiles)
+                            .arg(meanTileTime, 0, 'f', 1)
+                            .arg(stats.maxTileTime * 1e-6, 0, 'f', 1));
+}
+
+bool RayTracingDialog::saveStats(const RenderStats &stats, const QString &imagePath)
+{
+    // next to the image, with the same name: result.png -> result.json
+    QFileInfo imageInfo(imagePath);
+    QFile file(imageInfo.path() + "/" + imageInfo.completeBaseName() + ".json");
+    if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return false;
+    QJsonObject json = stats.toJson();
+    json["image"] = imageInfo.fileName();
+    json["width"] = ui->widthSpinBox->value();
+    json["height"] = ui->heightSpinBox->value();
+    return file.write(QJsonDocument(json).toJson()) >= 0;
+}
+
+void RayTracingDialog::setRendering(bool rendering)
+{
+    // the settings are fixed while a render runs
+    ui->widthSpinBox->setEnabled(!rendering);
+    ui->heightSpinBox->setEnabled(!rendering);
+    ui->depthSpinBox->setEnabled(!rendering);
+    ui->thresholdSpinBox->setEnabled(!rendering);
+    ui->minSamplesSpinBox->setEnabled(!rendering);
+    ui->maxSamplesSpinBox->setEnabled(!rendering);
+    ui->noiseSpinBox->setEnabled(!rendering);
+    ui->outputComboBox->setEnabled(!rendering);
+    ui->pushButton->setEnabled(!rendering);
+    ui->statsCheckBox->setEnabled(!rendering);
+    ui->buttonBox->button(QDialogButtonBox::Ok)->setEnabled(!rendering);
+    ui->pauseButton->setEnabled(rendering);
+    ui->pauseButton->setText(tr("暂停"));
+    ui->stopButton->setEnabled(rendering);
+}
@@ -2,6 +2,7 @@
 #define RAYTRACINGDIALOG_H
 
 #include <QDialog>
+#include <QImage>
 
 namespace Ui {
 class RayTracingDialog;
@@ -9,6 +10,8 @@ class RayTracingDialog;
 
 class Scene;
 class PerspectiveCamera;
+class RenderJob;
+struct RenderStats;
 
 class RayTracingDialog : public QDialog
 {
@@ -21,12 +24,27 @@ public:
     explicit RayTracingDialog(Scene *scene, PerspectiveCamera *camera, QWidget *parent = nullptr);
     ~RayTracingDialog();
 
+public slots:
+    // closing the dialog cancels a running render
+    void reject();
+
 private slots:
     void on_buttonBox_accepted();
     void on_pushButton_clicked();
+    void on_pauseButton_clicked();
+    void on_stopButton_clicked();
+    void showPreview(const QImage& image);
+    void renderFinished(const QImage& image, bool cancelled);
 
 private:
     Ui::RayTracingDialog *ui;
+    // the render in progress, null when idle
+    RenderJob *job;
+    QString savePath;
+
+    void setRendering(bool rendering);
+    void showStats(const RenderStats& stats);
+    bool saveStats(const RenderStats& stats, const QString& imagePath);
 
 };
 
@@ -4,6 +4,7 @@
 #include "model.h"
 #include "scene.h"
 #include "locallighting.h"
+#include "tasksystem.h"
 
 
 RayTracingCamera::RayTracingCamera() { }
@@ -27,8 +28,7 @@ PerspectiveCamera::PerspectiveCamera(float fov,
       m_nearDistance(nearDistance),
       m_focalDistance(focalDistance)
 {
-    m_right = cross(m_forward, targetUpDirection).normalized();
-    m_up = cross(m_right, m_forward);
+    setBasis(targetUpDirection);
 }
 
 PerspectiveCamera::~PerspectiveCamera()
@@ -41,91 +41,374 @@ void PerspectiveCamera::modifyPose(float fov, Point origin, Vector front, Vector
     m_tanFov = std::tan(fov * M_PI / 180.0f);
     m_origin = origin;
     m_forward = front.normalized();
-    m_right = cross(m_forward, targetUpDirection).normalized();
-    m_up = cross(m_right, m_forward);
+    setBasis(targetUpDirection);
+}
+
+void PerspectiveCamera::setBasis(const Vector& targetUpDirection)
+{
+    Float4 forward = toFloat4(m_forward);
+    Float4 right = normalize3(cross3(forward, toFloat4(targetUpDirection)));
+    m_right = toVector(right);
+    m_up = toVector(cross3(right, forward));
 }
 
 Ray PerspectiveCamera::makeRay(float xScreen, float yScreen) const
 {
-    Ray ray;
-    ray.m_origin = m_origin;
-    ray.m_direction = m_forward +
-                      m_right * ((xScreen - 0.5f) * m_tanFov) +
-                      m_up * ((yScreen - 0.5f) * m_tanFov);
-    ray.m_direction.normalize();
-    return ray;
+    Float4 direction = toFloat4(m_forward) +
+                       toFloat4(m_right) * Float4((xScreen - 0.5f) * m_tanFov) +
+                       toFloat4(m_up) * Float4((yScreen - 0.5f) * m_tanFov);
+    return Ray(m_origin, toVector(normalize3(direction)));
 }
 
-RenderThread::RenderThread(size_t xstart, size_t xend, size_t ystart, size_t yend,
+RenderWorker::RenderWorker(TileScheduler& scheduler, unsigned int worker,
                  Image *pImage,
                  Scene& masterSet,
                  const RayTracingCamera& cam,
-                 unsigned int maxRayDepth)
-        : m_xstart(xstart), m_xend(xend), m_ystart(ystart), m_yend(yend),
+                 const RenderSettings& settings,
+                 std::atomic<unsigned int>& tilesDone,
+                 const TileCallback& tileDone,
+                 RenderControl* pControl)
+        : m_scheduler(scheduler), m_worker(worker),
           m_pImage(pImage), m_masterSet(masterSet), m_camera(cam),
-          m_maxRayDepth(maxRayDepth) { }
+          m_settings(settings), m_tilesDone(tilesDone), m_tileDone(tileDone),
+          m_pControl(pControl), m_stats(RenderStats()) { }
 
 
-void RenderThread::run()
+void RenderWorker::run()
 {
-    // The aspect ratio is used to make the image only get more zoomed in when
-    // the height changes (and not the width)
-    float aspectRatioXToY = float(m_pImage->width()) / float(m_pImage->height());
+    // the thread's counters run on across renders, only the growth is ours
+    RenderStats start = threadRenderStats();
+    m_clock.start();
+    QElapsedTimer timer;
+    Tile tile;
+    while (m_scheduler.nextTile(m_worker, tile))
+    {
+        // the remaining tiles are dropped once the render is cancelled
+        if (m_pControl && !m_pControl->checkpoint())
+            break;
+        timer.start();
+        renderTile(tile);
+        uint64_t tileTime = static_cast<uint64_t>(timer.nsecsElapsed());
+        m_stats.tiles++;
+        m_stats.tileTime += tileTime;
+        m_stats.maxTileTime = std::max(m_stats.maxTileTime, tileTime);
+        unsigned int done = ++m_tilesDone;
+        if (m_tileDone)
+            m_tileDone(*m_pImage, tile, done, m_scheduler.tileCount());
+    }
+    m_stats += threadRenderStats() - start;
+}
+
+void RenderControl::cancel()
+{
+    QMutexLocker locker(&m_mutex);
+    m_cancelled = true;
+    // paused workers have to wake up to see it
+    m_resumed.wakeAll();
+}
+
+void RenderControl::setPaused(bool paused)
+{
+    QMutexLocker locker(&m_mutex);
+    m_paused = paused;
+    if (!paused)
+        m_resumed.wakeAll();
+}
+
+bool RenderControl::isPaused() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_paused;
+}
+
+bool RenderControl::checkpoint()
+{
+    QMutexLocker locker(&m_mutex);
+    while (m_paused && !m_cancelled)
+        m_resumed.wait(&m_mutex);
+    return !m_cancelled;
+}
+
+// mean luminance difference to a neighbour above which a pixel is taken as
+// lying on an edge, even if its own samples happen to agree
+const float kEdgeContrast = 0.05f;
+
+void RenderWorker::renderTile(const Tile &tile)
+{
+    // Every round takes one jittered sample in each cell of a strata x strata
+    // grid over the pixel, the smallest grid with at least minSamples cells
+    unsigned int strata = 1;
+    while (strata * strata < m_settings.minSamples)
+        ++strata;
+    unsigned int roundSize = strata * strata;
+    unsigned int maxSamples = std::max(m_settings.maxSamples, roundSize);
+
+    // First round for the tile and the pixels around it, so that edges along
+    // the tile border are found as well. The pixels around only feed the edge
+    // test and get a single center sample. The test can only change anything
+    // if a second round fits and a single sample does not force it already
+    // (isNoisy), otherwise the pixels around are left out.
+    size_t border = roundSize > 1 && roundSize + roundSize <= maxSamples ? 1 : 0;
+    size_t xstart = tile.xstart >= border ? tile.xstart - border : 0;
+    size_t ystart = tile.ystart >= border ? tile.ystart - border : 0;
+    size_t xend = std::min(tile.xend + border, m_pImage->width());
+    size_t yend = std::min(tile.yend + border, m_pImage->height());
+    size_t stride = xend - xstart;
+    m_estimates.resize(stride * (yend - ystart));
+    for (size_t y = ystart; y < yend; ++y)
+    {
+        for (size_t x = xstart; x < xend; ++x)
+        {
+            PixelEstimate& estimate = m_estimates[(y - ystart) * stride + x - xstart];
+            estimate.sum = Color(0.0f, 0.0f, 0.0f);
+            estimate.luminanceSum = 0.0f;
+            estimate.luminanceSquaredSum = 0.0f;
+            estimate.samples = 0;
+            estimate.cost = 0.0f;
+            // seeded by the pixel so that renders are repeatable whatever thread takes the tile
+            estimate.rng = static_cast<uint32_t>(y * m_pImage->width() + x) * 2654435761u + 1u;
+            bool inside = x >= tile.xstart && x < tile.xend && y >= tile.ystart && y < tile.yend;
+            sampleRound(x, y, inside ? strata : 1, estimate);
+        }
+    }
 
     // For each pixel row...
-    for (size_t y = m_ystart; y < m_yend; ++y)
+    for (size_t y = tile.ystart; y < tile.yend; ++y)
     {
         // For each pixel across the row...
-        for (size_t x = m_xstart; x < m_xend; ++x)
+        for (size_t x = tile.xstart; x < tile.xend; ++x)
         {
-            // Accumulate pixel color
-            Color pixelColor(0.0f, 0.0f, 0.0f);
-            size_t totalPixelSamples = 1;
-            // For each sample in the pixel...
-            for (size_t psi = 0; psi < totalPixelSamples; ++psi)
+            const PixelEstimate* center = &m_estimates[(y - ystart) * stride + x - xstart];
+            PixelEstimate estimate = *center;
+            float luminance = estimate.meanLuminance();
+            bool edge = (x > xstart && std::fabs((center - 1)->meanLuminance() - luminance) > kEdgeContrast) ||
+                        (x + 1 < xend && std::fabs((center + 1)->meanLuminance() - luminance) > kEdgeContrast) ||
+                        (y > ystart && std::fabs((center - stride)->meanLuminance() - luminance) > kEdgeContrast) ||
+                        (y + 1 < yend && std::fabs((center + stride)->meanLuminance() - luminance) > kEdgeContrast);
+            // Spend more samples only where the pixel is not settled yet
+            while (estimate.samples + roundSize <= maxSamples && (edge || isNoisy(estimate)))
             {
-                float xu = x / float(m_pImage->width());
-                // Flip pixel row to be in screen space (images are top-down)
-                float yu = 1.0f - y / float(m_pImage->height());
-                // Find where this pixel sample hits in the scene
-                Ray ray = m_camera.makeRay((xu - 0.5f) * aspectRatioXToY + 0.5f, yu);
-                // Trace a path out, gathering estimated radiance along the path
-                pixelColor += traceRay(ray, m_masterSet, m_maxRayDepth);
+                sampleRound(x, y, strata, estimate);
+                edge = false;
             }
             // Divide by the number of pixel samples (a box pixel filter, essentially)
-            pixelColor /= totalPixelSamples;
+            Color pixelColor = estimate.sum / float(estimate.samples);
+            // heatmaps keep the raw cost until the whole image is known
+            if (m_settings.output != ShadedOutput)
+                pixelColor = Color(estimate.cost);
             // Store off the computed pixel in a big buffer
             m_pImage->pixel(x, y) = pixelColor;
         }
     }
 }
 
-Color traceRay(const Ray& ray, Scene& scene, unsigned int maxRayDepth)
+// random number in [0, 1) from a xorshift generator
+static float nextRandom(uint32_t& state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (state >> 8) * (1.0f / 16777216.0f);
+}
+
+void RenderWorker::sampleRound(size_t x, size_t y, unsigned int strata, PixelEstimate &estimate)
+{
+    // The aspect ratio is used to make the image only get more zoomed in when
+    // the height changes (and not the width)
+    float aspectRatioXToY = float(m_pImage->width()) / float(m_pImage->height());
+    bool heatmap = m_settings.output != ShadedOutput;
+    double costBefore = heatmap ? costCounter() : 0.0;
+
+    for (unsigned int sy = 0; sy < strata; ++sy)
+    {
+        for (unsigned int sx = 0; sx < strata; ++sx)
+        {
+            // single sample rounds start at the pixel center and jitter over
+            // the whole pixel from the second sample on
+            bool jitter = strata > 1 || estimate.samples > 0;
+            float jx = jitter ? (sx + nextRandom(estimate.rng)) / strata : 0.5f;
+            float jy = jitter ? (sy + nextRandom(estimate.rng)) / strata : 0.5f;
+            float xu = (x + jx) / float(m_pImage->width());
+            // Flip pixel row to be in screen space (images are top-down)
+            float yu = 1.0f - (y + jy) / float(m_pImage->height());
+            // Find where this pixel sample hits in the scene
+            Ray ray = m_camera.makeRay((xu - 0.5f) * aspectRatioXToY + 0.5f, yu);
+            // Trace a path out, gathering estimated radiance along the path
+            Color sample = traceRay(ray, m_masterSet, m_settings);
+            estimate.sum += sample;
+            float luminance = sample.luminance();
+            estimate.luminanceSum += luminance;
+            estimate.luminanceSquaredSum += luminance * luminance;
+            ++estimate.samples;
+        }
+    }
+    if (heatmap)
+        estimate.cost += float(costCounter() - costBefore);
+}
+
+double RenderWorker::costCounter() const
 {
+    switch (m_settings.output)
+    {
+    case TraversalHeatmap:
+        return double(threadRenderStats().nodesVisited);
+    case TriangleHeatmap:
+        return double(threadRenderStats().triangleTests);
+    case TimeHeatmap:
+        return double(m_clock.nsecsElapsed());
+    default:
+        return 0.0;
+    }
+}
+
+bool RenderWorker::isNoisy(const PixelEstimate &estimate) const
+{
+    // a variance needs two samples at least
+    if (estimate.samples < 2)
+        return true;
+    float mean = estimate.meanLuminance();
+    float variance = std::max(0.0f, (estimate.luminanceSquaredSum - estimate.samples * mean * mean) / (estimate.samples - 1));
+    // squared standard error of the mean
+    return variance / estimate.samples > m_settings.noiseThreshold * m_settings.noiseThreshold;
+}
+
+Color traceRay(const Ray& ray, Scene& scene, const RenderSettings& settings)
+{
+    // Rays still to trace, with the weight of their color in the pixel. The
+    // tree is walked depth first, so the stack holds at most one pending
+    // sibling per level plus the ray being expanded.
+    struct PendingRay
+    {
+        Point origin;
+        Vector direction;
+        Color throughput;
+        unsigned int depth;
+    };
+    PendingRay stack[kMaxRayDepth + 1];
+    unsigned int maxRayDepth = std::min(settings.maxRayDepth, kMaxRayDepth);
     if(maxRayDepth == 0)
         return Color(0.0f, 0.0f, 0.0f);
-    Intersection intersection(ray);
-    if (!scene.intersect(intersection))
-        return Color(0.0f, 0.0f, 0.0f);
-    Color localLightingColor = PhongLighting(intersection.m_intersect,
-                                             intersection.m_normal,
-                                             ray.m_direction,
-                                             scene,
-                                             intersection.m_pModel->ka,
-                                             intersection.m_pModel->ks,
-                                             intersection.m_pModel->n);
-    Vector reflection = reflect(ray.m_direction, intersection.m_normal);
-    Ray reflectionRay(intersection.m_intersect, reflection);
-    Color reflectionColor = traceRay(reflectionRay, scene, maxRayDepth-1);
-    Ray transmissionRay(intersection.m_intersect, ray.m_direction);
-    Color transmissionColor = traceRay(transmissionRay, scene, maxRayDepth-1);
-    Color ks(intersection.m_pModel->ks);
-    Color kt(intersection.m_pModel->kt);
-    Color resultColor = localLightingColor + ks * reflectionColor + kt * transmissionColor;
+
+    Color resultColor(0.0f, 0.0f, 0.0f);
+    unsigned int secondaryRays = 0;
+    unsigned int top = 0;
+    stack[top].origin = ray.m_origin;
+    stack[top].direction = ray.m_direction;
+    stack[top].throughput = Color(1.0f);
+    stack[top].depth = 1;
+    top++;
+    while(top > 0)
+    {
+        PendingRay pending = stack[--top];
+        if(pending.depth > 1)
+            secondaryRays++;
+        // the directions are normalized already
+        Ray pendingRay;
+        pendingRay.m_origin = pending.origin;
+        pendingRay.m_direction = pending.direction;
+        pendingRay.precompute();
+        Intersection intersection;
+        if (!scene.intersect(pendingRay, intersection))
+            continue;
+        const Model *model = intersection.m_pModel;
+        // shading attributes of the closest hit only
+        SurfaceInteraction surface = model->surfaceInteraction(pendingRay, intersection);
+        Color localLightingColor = PhongLighting(surface.m_position,
+                                                 surface.m_normal,
+                                                 pendingRay.m_direction,
+                                                 intersection.m_t,
+                                                 scene,
+                                                 settings.lightFlag,
+                                                 model->ka,
+                                                 model->ks,
+                                                 model->n);
+        localLightingColor.clamp();
+        resultColor += pending.throughput * localLightingColor;
+        if(pending.depth >= maxRayDepth)
+            continue;
+
+        // only follow the branches that can still change the pixel
+        Color reflectionWeight = pending.throughput * Color(model->ks);
+        if(reflectionWeight.maxComponent() > settings.minThroughput)
+        {
+            Vector direction = reflect(pendingRay.m_direction, surface.m_normal);
+            stack[top].origin = offsetRayOrigin(surface.m_position, surface.m_normal, direction, intersection.m_t);
+            stack[top].direction = direction;
+            stack[top].throughput = reflectionWeight;
+            stack[top].depth = pending.depth + 1;
+            top++;
+        }
+        Color transmissionWeight = pending.throughput * Color(model->kt);
+        if(transmissionWeight.maxComponent() > settings.minThroughput)
+        {
+            // leaves through the far side of the surface
+            stack[top].origin = offsetRayOrigin(surface.m_position, surface.m_normal,
+                                                pendingRay.m_direction, intersection.m_t);
+            stack[top].direction = pendingRay.m_direction;
+            stack[top].throughput = transmissionWeight;
+            stack[top].depth = pending.depth + 1;
+            top++;
+        }
+    }
+    RenderStats& stats = threadRenderStats();
+    stats.primaryRays++;
+    stats.secondaryRays += secondaryRays;
     resultColor.clamp();
     return resultColor;
 }
 
+void applyHeatmap(Image &image)
+{
+    size_t count = image.width() * image.height();
+    if (count == 0)
+        return;
+    // scale to the 99th percentile, a few stalled pixels (time) or pixels
+    // looking down a long thin mesh should not wash out the rest
+    std::vector<float> costs(count);
+    for (size_t i = 0; i < count; ++i)
+        costs[i] = image.pixel(i % image.width(), i / image.width()).m_r;
+    std::vector<float>::iterator percentile = costs.begin() + (count - 1) * 99 / 100;
+    std::nth_element(costs.begin(), percentile, costs.end());
+    float scale = *percentile > 0.0f ? 1.0f / *percentile : 0.0f;
+
+    // blue, cyan, green, yellow, red
+    static const Color ramp[] = {
+        Color(0.0f, 0.0f, 1.0f), Color(0.0f, 1.0f, 1.0f), Color(0.0f, 1.0f, 0.0f),
+        Color(1.0f, 1.0f, 0.0f), Color(1.0f, 0.0f, 0.0f)
+    };
+    const int last = sizeof(ramp) / sizeof(ramp[0]) - 1;
+    for (size_t y = 0; y < image.height(); ++y)
+    {
+        for (size_t x = 0; x < image.width(); ++x)
+        {
+            float t = std::min(image.pixel(x, y).m_r * scale, 1.0f) * last;
+            int i = std::min(static_cast<int>(t), last - 1);
+            float f = t - i;
+            image.pixel(x, y) = ramp[i] * (1.0f - f) + ramp[i + 1] * f;
+        }
+    }
+}
+
+QRgb toQRgb(Color color)
+{
+    color.clamp();
+    return qRgb(static_cast<int>(color.m_r * 255.0f),
+                static_cast<int>(color.m_g * 255.0f),
+                static_cast<int>(color.m_b * 255.0f));
+}
+
+QImage toQImage(const Image &image)
+{
+    QImage result(static_cast<int>(image.width()), static_cast<int>(image.height()), QImage::Format_RGB32);
+    for (size_t y = 0; y < image.height(); ++y)
+    {
+        QRgb *line = reinterpret_cast<QRgb*>(result.scanLine(static_cast<int>(y)));
+        for (size_t x = 0; x < image.width(); ++x)
+            line[x] = toQRgb(image.pixel(x, y));
+    }
+    return result;
+}
+
 //Image* renderRayTracing(Scene& scene,
 //                        const RayTracingCamera& cam,
 //                        size_t width,
@@ -174,79 +457,65 @@ Image* renderRayTracing(Scene& scene,
                         const RayTracingCamera& cam,
                         size_t width,
                         size_t height,
-                        unsigned int maxRayDepth)
+                        const RenderSettings& settings,
+                        const TileCallback& tileDone,
+                        RenderControl* pControl,
+                        RenderStats* pStats)
 {
+    QElapsedTimer timer;
+    timer.start();
+
     // Set up the output image
     Image *pImage = new Image(width, height);
 
-    // Set up render threads; we make as much as 16 chunks of the image that
-    // can render in parallel.
-    const size_t kChunkDim = 4;
-
-    // Chunk size is the number of pixels per image chunk (we have to take care
-    // to deal with tiny images)
-    size_t xChunkSize = width >= kChunkDim ? width / kChunkDim : 1;
-    size_t yChunkSize = height >= kChunkDim ? height / kChunkDim : 1;
-    // Chunks are the number of chunks in each dimension we can chop the image
-    // into (again, taking care to deal with tiny images, and also images that
-    // don't divide clealy into 4 chunks)
-    size_t xChunks = width > kChunkDim ? width / xChunkSize : 1;
-    size_t yChunks = height > kChunkDim ? height / yChunkSize : 1;
-    if (xChunks * xChunkSize < width) xChunks++;
-    if (yChunks * yChunkSize < height) yChunks++;
-
-    // Set up render threads
-    size_t numRenderThreads = xChunks * yChunks;
-    RenderThread **renderThreads = new RenderThread*[numRenderThreads];
-
-    // Launch render threads
-    for (size_t yc = 0; yc < yChunks; ++yc)
+    // Make sure the top level BVH matches the current model placement
+    scene.updateTopLevel();
+    RenderSettings renderSettings = settings;
+    if (renderSettings.lightFlag.empty())
+        renderSettings.lightFlag = scene.lightFlag;
+
+    // Cut the image into small tiles and run one render worker per core on
+    // the shared pool; the workers pull tiles from the scheduler and steal
+    // from each other when they run out, so expensive regions do not hold up
+    // the others. The calling thread renders too while it waits.
+    unsigned int numWorkers = static_cast<unsigned int>(taskWorkerCount());
+    TileScheduler scheduler(width, height, kTileSize, numWorkers);
+    std::atomic<unsigned int> tilesDone(0);
+    std::vector<RenderWorker> workers;
+    workers.reserve(numWorkers);
+    for (unsigned int i = 0; i < numWorkers; ++i)
     {
-        size_t yStart = yc * yChunkSize;
-        size_t yEnd = std::min((yc + 1) * yChunkSize, height);
-        for (size_t xc = 0; xc < xChunks; ++xc)
-        {
-            size_t xStart = xc * xChunkSize;
-            size_t xEnd = std::min((xc + 1) * xChunkSize, width);
-            renderThreads[yc * xChunks + xc] = new RenderThread(xStart,
-                                                                xEnd,
-                                                                yStart,
-                                                                yEnd,
-                                                                pImage,
-                                                                scene,
-                                                                cam,
-                                                                maxRayDepth);
-            renderThreads[yc * xChunks + xc]->start();
-        }
+        workers.push_back(RenderWorker(scheduler,
+                                       i,
+                                       pImage,
+                                       scene,
+                                       cam,
+                                       renderSettings,
+                                       tilesDone,
+                                       tileDone,
+                                       pControl));
     }
 
-    // Wait until the render finishes
-    bool stillRunning;
-    do
+    // Block until every worker has finished
+    TaskGroup group(HighPriority);
+    for (unsigned int i = 0; i < numWorkers; ++i)
     {
-        // See if any render thread is still going
-        stillRunning = false;
-        for (size_t i = 0; i < numRenderThreads; ++i)
-        {
-            if (renderThreads[i]->isRunning())
-            {
-                stillRunning = true;
-                break;
-            }
-        }
-        if (stillRunning)
-        {
-            // Give up the CPU so the render threads can do their thing
-            QThread::yieldCurrentThread();
-        }
-    } while (stillRunning);
+        RenderWorker *worker = &workers[i];
+        group.run([worker]{ worker->run(); });
+    }
+    group.wait();
 
-    // Clean up render thread objects
-    for (size_t i = 0; i < numRenderThreads; ++i)
+    // The workers are done, so their counters can be added up as they are
+    if (pStats)
     {
-        delete renderThreads[i];
+        *pStats = RenderStats();
+        for (unsigned int i = 0; i < numWorkers; ++i)
+            *pStats += workers[i].stats();
+        pStats->renderTime = static_cast<uint64_t>(timer.nsecsElapsed());
     }
-    delete[] renderThreads;
+
+    if (settings.output != ShadedOutput)
+        applyHeatmap(*pImage);
 
     return pImage;
 }
@@ -1,8 +1,16 @@
 #ifndef RAYTRACINGSCENE_H
 #define RAYTRACINGSCENE_H
 
-#include <QThread>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <QElapsedTimer>
+#include <QImage>
+#include <QMutex>
+#include <QWaitCondition>
 #include "raytracing/basic.h"
+#include "tilescheduler.h"
+#include "renderstats.h"
 
 class RayTracingCamera
 {
@@ -29,6 +37,9 @@ public:
     Ray makeRay(float xScreen, float yScreen) const;
 
 protected:
+    // m_right and m_up from m_forward and the up direction asked for
+    void setBasis(const Vector& targetUpDirection);
+
     Point m_origin;
     Vector m_forward;
     Vector m_right;
@@ -54,6 +65,11 @@ public:
         return m_pixels[y * m_width + x];
     }
 
+    const Color& pixel(size_t x, size_t y) const
+    {
+        return m_pixels[y * m_width + x];
+    }
+
 protected:
     size_t m_width, m_height;
     Color *m_pixels;
@@ -63,31 +79,151 @@ class Scene;
 class Light;
 class RayTracingCamera;
 
-class RenderThread : public QThread
+// the ray tree is traced with an explicit stack of this size
+const unsigned int kMaxRayDepth = 64;
+
+// What a pixel shows: its shaded color, or what it cost to render (BVH
+// nodes visited, triangles tested or time taken over all its samples) on a
+// false color ramp from blue (cheapest) to red (most expensive)
+enum RenderOutput {ShadedOutput, TraversalHeatmap, TriangleHeatmap, TimeHeatmap};
+
+struct RenderSettings
+{
+    // number of bounces, at most kMaxRayDepth
+    unsigned int maxRayDepth;
+    // reflection and transmission rays whose weight in the pixel is not
+    // above this are not traced
+    float minThroughput;
+
+    // Adaptive antialiasing: every pixel takes minSamples stratified samples
+    // (rounded up to a square grid). Pixels that differ clearly from a neighbour
+    // get another round of the same size, and rounds go on while the
+    // standard error of the pixel's mean luminance is above noiseThreshold,
+    // up to maxSamples in total. Flat regions stop early, edges and noisy
+    // areas get the extra samples.
+    unsigned int minSamples;
+    unsigned int maxSamples;
+    float noiseThreshold;
+
+    RenderOutput output;
+
+    // the lights that are switched on, by index into Scene::lights; lights
+    // without a flag are on. renderRayTracing() takes Scene::lightFlag when
+    // this is empty, a render running in the background gets its own copy so
+    // that switching lights in the GUI does not race with it.
+    std::vector<bool> lightFlag;
+
+    RenderSettings()
+        : maxRayDepth(3), minThroughput(0.01f),
+          minSamples(4), maxSamples(16), noiseThreshold(0.01f),
+          output(ShadedOutput) { }
+};
+
+// Called after every finished tile with the image being rendered and the
+// number of tiles done so far. It runs on the render thread that finished the
+// tile, so it must be thread safe; only the pixels of that tile are final.
+// GUI code should forward it through a queued signal.
+typedef std::function<void(const Image& image, const Tile& tile,
+                           unsigned int tilesDone, unsigned int tileCount)> TileCallback;
+
+// Lets another thread pause or cancel a running render. The workers look at
+// it before every tile, so a tile that has been started is always finished.
+class RenderControl
 {
 public:
-    RenderThread(size_t xstart, size_t xend, size_t ystart, size_t yend,
+    RenderControl() : m_cancelled(false), m_paused(false) { }
+
+    void cancel();
+    void setPaused(bool paused);
+    bool isCancelled() const { return m_cancelled.load(); }
+    bool isPaused() const;
+
+    // blocks while paused, false once the render has been cancelled
+    bool checkpoint();
+
+private:
+    std::atomic<bool> m_cancelled;
+    bool m_paused;
+    mutable QMutex m_mutex;
+    QWaitCondition m_resumed;
+};
+
+// Renders tiles taken from the scheduler until the image is done, one
+// worker runs as a task on the shared pool
+class RenderWorker
+{
+public:
+    RenderWorker(TileScheduler& scheduler, unsigned int worker,
                  Image *pImage,
                  Scene& masterSet,
                  const RayTracingCamera& cam,
-                 unsigned int maxRayDepth);
+                 const RenderSettings& settings,
+                 std::atomic<unsigned int>& tilesDone,
+                 const TileCallback& tileDone,
+                 RenderControl* pControl);
+
+    void run();
+
+    // what this worker did in its run
+    const RenderStats& stats() const { return m_stats; }
 
 protected:
-    virtual void run();
+    void renderTile(const Tile& tile);
 
-    size_t m_xstart, m_xend, m_ystart, m_yend;
+    // running estimate of a pixel's color over its samples so far
+    struct PixelEstimate
+    {
+        Color sum;
+        float luminanceSum, luminanceSquaredSum;
+        unsigned int samples;
+        uint32_t rng;
+        // heatmap outputs only: cost of the samples so far
+        float cost;
+
+        float meanLuminance() const { return luminanceSum / samples; }
+    };
+    void sampleRound(size_t x, size_t y, unsigned int strata, PixelEstimate& estimate);
+    bool isNoisy(const PixelEstimate& estimate) const;
+    // running count of the cost the heatmap output shows
+    double costCounter() const;
+
+    TileScheduler& m_scheduler;
+    unsigned int m_worker;
     Image *m_pImage;
     Scene& m_masterSet;
     const RayTracingCamera& m_camera;
-    unsigned int m_maxRayDepth;
+    RenderSettings m_settings;
+    // first round estimates of a tile and a one pixel border, reused between tiles
+    std::vector<PixelEstimate> m_estimates;
+    std::atomic<unsigned int>& m_tilesDone;
+    const TileCallback& m_tileDone;
+    RenderControl* m_pControl;
+    RenderStats m_stats;
+    // started with the run, for the time heatmap
+    QElapsedTimer m_clock;
 };
 
-Color traceRay(const Ray& ray, Scene& scene, unsigned int maxRayDepth);
+Color traceRay(const Ray& ray, Scene& scene, const RenderSettings& settings);
+
+// Replaces the costs a heatmap render left in the pixels by the false color
+// ramp, scaled to the costliest pixels of the image
+void applyHeatmap(Image& image);
+
+// 32-bit RGB color and image, colors are clamped to [0, 1]
+QRgb toQRgb(Color color);
+QImage toQImage(const Image& image);
 
+// Renders the whole image. With a control the render can be paused and
+// cancelled from another thread; a cancelled render returns the image with
+// the tiles that were done so far. The counters of the render are stored in
+// *pStats if given.
 Image* renderRayTracing(Scene& scene,
                 const RayTracingCamera& cam,
                 size_t width,
                 size_t height,
-                unsigned int maxRayDepth);
+                const RenderSettings& settings,
+                const TileCallback& tileDone = TileCallback(),
+                RenderControl* pControl = nullptr,
+                RenderStats* pStats = nullptr);
 
 #endif // RAYTRACINGSCENE_H
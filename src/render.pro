@@ -0,0 +1,65 @@
+#-------------------------------------------------
+#
+# Command line ray tracer, runs without a window or GL context:
+#     rover-render scene.json -w 1920 -h 1080 -d 4 -o out.png
+#
+#-------------------------------------------------
+
+# gui is only needed for QImage and the math types, no widgets
+QT       += core gui
+QT       -= widgets
+
+TARGET = rover-render
+TEMPLATE = app
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+SOURCES += \
+    rendermain.cpp \
+    raytracingscene.cpp \
+    scene.cpp \
+    aabb.cpp \
+    bvh.cpp \
+    camera.cpp \
+    locallighting.cpp \
+    triangleblock.cpp \
+    tilescheduler.cpp \
+    tasksystem.cpp \
+    modelcache.cpp \
+    assetregistry.cpp
+
+HEADERS += \
+    camera.h \
+    global.h \
+    stb_image.h \
+    mesh.h \
+    aabb.h \
+    bvh.h \
+    raytracingscene.h \
+    objmodel.h \
+    model.h \
+    scene.h \
+    raytracing/basic.h \
+    raytracing/simd.h \
+    light.h \
+    locallighting.h \
+    triangleblock.h \
+    tilescheduler.h \
+    tasksystem.h \
+    renderstats.h \
+    modelcache.h \
+    assetregistry.h
+
+INCLUDEPATH += C:\opengl\include \
+            C:\assimp-3.3.1\include \
+
+LIBS += C:\assimp-3.3.1\lib\libassimp.dll.a \
+        C:\assimp-3.3.1\lib\libzlibstatic.a
+
+# Default rules for deployment.
+qnx: target.path = /tmp/$${TARGET}/bin
+else: unix:!android: target.path = /opt/$${TARGET}/bin
+!isEmpty(target.path): INSTALLS += target
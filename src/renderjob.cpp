@@ -0,0 +1,104 @@
+#include "renderjob.h"
+
+#include <algorithm>
+#include "scene.h"
+
+// the first coarse pass renders every 8th pixel in both directions
+const size_t kCoarsestScale = 8;
+// least time between two previews of the full resolution pass, in ms
+const qint64 kPreviewInterval = 250;
+
+RenderJob::RenderJob(Scene &scene, const PerspectiveCamera &camera,
+                     size_t width, size_t height, const RenderSettings &settings,
+                     QObject *parent)
+    : QObject(parent), m_scene(scene), m_camera(camera),
+      m_width(width), m_height(height), m_settings(settings),
+      m_stats(RenderStats()), m_task(HighPriority)
+{
+    // the light menu keeps switching lights while the render runs
+    m_settings.lightFlag = scene.lightFlag;
+}
+
+RenderJob::~RenderJob()
+{
+    cancel();
+    m_task.wait();
+}
+
+void RenderJob::start()
+{
+    m_task.run([this]{ render(); });
+}
+
+void RenderJob::cancel()
+{
+    m_control.cancel();
+}
+
+void RenderJob::setPaused(bool paused)
+{
+    m_control.setPaused(paused);
+}
+
+void RenderJob::render()
+{
+    // coarse passes take a single sample per pixel
+    RenderSettings coarseSettings = m_settings;
+    coarseSettings.minSamples = 1;
+    coarseSettings.maxSamples = 1;
+    for (size_t scale = kCoarsestScale; scale > 1; scale /= 2)
+    {
+        size_t width = std::max<size_t>(m_width / scale, 1);
+        size_t height = std::max<size_t>(m_height / scale, 1);
+        Image *pImage = renderRayTracing(m_scene, m_camera, width, height, coarseSettings,
+                                         TileCallback(), &m_control);
+        if (!m_control.isCancelled())
+        {
+            QImage preview = toQImage(*pImage).scaled(static_cast<int>(m_width), static_cast<int>(m_height));
+            QMutexLocker locker(&m_previewMutex);
+            m_preview = preview;
+            emit previewUpdated(m_preview.copy());
+        }
+        delete pImage;
+        if (m_control.isCancelled())
+        {
+            emit finished(QImage(), true);
+            return;
+        }
+    }
+
+    m_lastPublished.start();
+    Image *pImage = renderRayTracing(m_scene, m_camera, m_width, m_height, m_settings,
+                                     [this](const Image& image, const Tile& tile,
+                                            unsigned int tilesDone, unsigned int tileCount){
+                                         tileFinished(image, tile, tilesDone, tileCount);
+                                     },
+                                     &m_control, &m_stats);
+    bool cancelled = m_control.isCancelled();
+    QImage result = cancelled ? QImage() : toQImage(*pImage);
+    delete pImage;
+    emit finished(result, cancelled);
+}
+
+void RenderJob::tileFinished(const Image &image, const Tile &tile,
+                             unsigned int tilesDone, unsigned int tileCount)
+{
+    QMutexLocker locker(&m_previewMutex);
+    // heatmap tiles hold raw costs until the end, the coarse heatmap stays up
+    if (m_settings.output == ShadedOutput)
+    {
+        for (size_t y = tile.ystart; y < tile.yend; ++y)
+        {
+            QRgb *line = reinterpret_cast<QRgb*>(m_preview.scanLine(static_cast<int>(y)));
+            for (size_t x = tile.xstart; x < tile.xend; ++x)
+                line[x] = toQRgb(image.pixel(x, y));
+        }
+    }
+    emit progressChanged(static_cast<int>(tilesDone * 100 / tileCount));
+    // the last tile is left to finished()
+    if (tilesDone < tileCount && m_lastPublished.elapsed() >= kPreviewInterval)
+    {
+        m_lastPublished.restart();
+        emit previewUpdated(m_preview.copy());
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef RENDERJOB_H
+#define RENDERJOB_H
+
+#include <QObject>
+#include <QImage>
+#include <QMutex>
+#include <QElapsedTimer>
+#include "raytracingscene.h"
+#include "tasksystem.h"
+
+// A ray tracing render that runs on the shared pool instead of the GUI
+// thread. It starts with quick one sample passes at 1/8, 1/4 and 1/2 of the
+// resolution, then renders the full image with the given settings and paints
+// its tiles over the last coarse pass as they finish. Every step is published
+// through previewUpdated, so the framing can be checked after a moment.
+// The signals are emitted from pool threads; connect them to GUI objects
+// with the default (queued) connection.
+class RenderJob : public QObject
+{
+    Q_OBJECT
+
+public:
+    // create it on the GUI thread: the camera and the light switches are
+    // copied, the rest of the scene must stay alive and unchanged until finished
+    RenderJob(Scene& scene, const PerspectiveCamera& camera,
+              size_t width, size_t height, const RenderSettings& settings,
+              QObject *parent = nullptr);
+    // cancels the render and waits for it to stop
+    ~RenderJob();
+
+    void start();
+    void cancel();
+    void setPaused(bool paused);
+    bool isPaused() const { return m_control.isPaused(); }
+    // counters of the full resolution pass, set before finished is emitted
+    const RenderStats& stats() const { return m_stats; }
+
+signals:
+    void previewUpdated(const QImage& image);
+    // percentage of the full resolution pass that is done
+    void progressChanged(int percent);
+    // the finished image, or a null image if the render was cancelled
+    void finished(const QImage& image, bool cancelled);
+
+private:
+    void render();
+    void tileFinished(const Image& image, const Tile& tile,
+                      unsigned int tilesDone, unsigned int tileCount);
+
+    Scene& m_scene;
+    PerspectiveCamera m_camera;
+    size_t m_width, m_height;
+    RenderSettings m_settings;
+    RenderControl m_control;
+    RenderStats m_stats;
+
+    // full size preview, the coarse passes scaled up with finished tiles on top
+    QMutex m_previewMutex;
+    QImage m_preview;
+    QElapsedTimer m_lastPublished;
+
+    TaskGroup m_task;
+};
+
+#endif // RENDERJOB_H
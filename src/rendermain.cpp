@@ -0,0 +1,175 @@
+// Command line ray tracer: loads a scene description and renders it on the
+// CPU, without a window or GL context, e.g.
+//     rover-render scene.json -w 1920 -h 1080 -d 4 -o out.png
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QImage>
+#include <QJsonDocument>
+#include <algorithm>
+#include <iostream>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "camera.h"
+#include "raytracingscene.h"
+#include "scene.h"
+#include "objmodel.h"
+#include "bvh.h"
+#include "modelcache.h"
+#include "assetregistry.h"
+#include "tasksystem.h"
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QCoreApplication::setApplicationName("rover-render");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Renders a scene description with the ray tracer.");
+    // -h is the image height, so the help option is spelled out
+    QCommandLineOption helpOption("help", "Displays this help.");
+    QCommandLineOption widthOption("w", "Image width.", "width", "1200");
+    QCommandLineOption heightOption("h", "Image height.", "height", "800");
+    QCommandLineOption depthOption("d", "Maximum ray depth.", "depth", QString::number(RenderSettings().maxRayDepth));
+    QCommandLineOption outputOption("o", "Output image.", "file", "raytracing_result.png");
+    QCommandLineOption minSamplesOption("min-samples", "Samples every pixel takes, rounded up to a square grid.", "n",
+                                        QString::number(RenderSettings().minSamples));
+    QCommandLineOption maxSamplesOption("max-samples", "Samples a pixel takes at most.", "n",
+                                        QString::number(RenderSettings().maxSamples));
+    QCommandLineOption heatmapOption("heatmap", "Color the pixels by their cost instead: nodes (BVH nodes visited), triangles (triangles tested) or time.", "cost");
+    QCommandLineOption bvhOption("bvh", "BVH traversal: binary or wide (4 boxes per step).", "layout",
+                                 bvhLayoutName(bvhLayout()));
+    QCommandLineOption builderOption("builder", "BVH builder: sah, or morton for a faster build of a slower tree.", "builder",
+                                     bvhBuilderName(bvhBuilder()));
+    QCommandLineOption cacheDirOption("cache-dir", "Directory of the model cache.", "dir", modelCacheDirectory());
+    QCommandLineOption noCacheOption("no-cache", "Import every model and build its BVH instead of using the model cache.");
+    QCommandLineOption statsOption("stats", "Also write the render counters as JSON next to the output image.");
+    parser.addOption(helpOption);
+    parser.addOption(widthOption);
+    parser.addOption(heightOption);
+    parser.addOption(depthOption);
+    parser.addOption(outputOption);
+    parser.addOption(minSamplesOption);
+    parser.addOption(maxSamplesOption);
+    parser.addOption(heatmapOption);
+    parser.addOption(bvhOption);
+    parser.addOption(builderOption);
+    parser.addOption(cacheDirOption);
+    parser.addOption(noCacheOption);
+    parser.addOption(statsOption);
+    parser.addPositionalArgument("scene", "Scene description file (.json), model paths are relative to the working directory.");
+    parser.process(a);
+
+    if(parser.isSet(helpOption) || parser.positionalArguments().size() != 1){
+        std::cout << parser.helpText().toStdString();
+        return parser.isSet(helpOption) ? 0 : 1;
+    }
+
+    int width = parser.value(widthOption).toInt();
+    int height = parser.value(heightOption).toInt();
+    int depth = parser.value(depthOption).toInt();
+    if(width <= 0 || height <= 0 || depth <= 0 || depth > int(kMaxRayDepth)){
+        std::cerr << "invalid image size or ray depth" << std::endl;
+        return 1;
+    }
+    RenderSettings settings;
+    settings.maxRayDepth = static_cast<unsigned int>(depth);
+    settings.minSamples = static_cast<unsigned int>(std::max(parser.value(minSamplesOption).toInt(), 1));
+    settings.maxSamples = static_cast<unsigned int>(std::max(parser.value(maxSamplesOption).toInt(), 1));
+    if(parser.isSet(heatmapOption)){
+        QString cost = parser.value(heatmapOption);
+        if(cost == "nodes")
+            settings.output = TraversalHeatmap;
+        else if(cost == "triangles")
+            settings.output = TriangleHeatmap;
+        else if(cost == "time")
+            settings.output = TimeHeatmap;
+        else{
+            std::cerr << "unknown heatmap cost " << cost.toStdString() << std::endl;
+            return 1;
+        }
+    }
+
+    QString layout = parser.value(bvhOption);
+    if(layout == "binary")
+        setBVHLayout(BinaryBVH);
+    else if(layout == "wide")
+        setBVHLayout(WideBVH);
+    else{
+        std::cerr << "unknown BVH layout " << layout.toStdString() << std::endl;
+        return 1;
+    }
+
+    QString builder = parser.value(builderOption);
+    if(builder == "sah")
+        setBVHBuilder(SAHBuilder);
+    else if(builder == "morton")
+        setBVHBuilder(MortonBuilder);
+    else{
+        std::cerr << "unknown BVH builder " << builder.toStdString() << std::endl;
+        return 1;
+    }
+
+    setModelCacheDirectory(parser.isSet(noCacheOption) ? QString() : parser.value(cacheDirOption));
+
+    // the models stay on the CPU since they are never drawn
+    QByteArray sceneFile = parser.positionalArguments().at(0).toLocal8Bit();
+    QElapsedTimer timer;
+    timer.start();
+    Scene scene(sceneFile.constData());
+    scene.loadScene();
+    qint64 loadTime = timer.restart();
+
+    // same view as the main window right after loading the scene
+    Camera camera(scene.camera_position,
+                  scene.camera_up,
+                  scene.camera_yaw,
+                  scene.camera_pitch,
+                  scene.camera_nearplane,
+                  scene.camera_farplane);
+    PerspectiveCamera perspectiveCamera(camera.zoom,
+                                        Point(camera.position),
+                                        Vector(camera.front),
+                                        Vector(camera.up),
+                                        scene.camera_nearDistance,
+                                        scene.camera_focalDistance);
+
+    RenderStats stats = RenderStats();
+    Image *pImage = renderRayTracing(scene, perspectiveCamera, width, height, settings,
+                                     TileCallback(), nullptr, &stats);
+    qint64 renderTime = timer.elapsed();
+    QString output = parser.value(outputOption);
+    bool saved = toQImage(*pImage).save(output);
+    delete pImage;
+    if(!saved){
+        std::cerr << "could not write " << output.toStdString() << std::endl;
+        return 1;
+    }
+
+    if(parser.isSet(statsOption)){
+        // result.png -> result.json
+        QFileInfo outputInfo(output);
+        QFile file(outputInfo.path() + "/" + outputInfo.completeBaseName() + ".json");
+        QJsonObject json = stats.toJson();
+        json["image"] = outputInfo.fileName();
+        json["width"] = width;
+        json["height"] = height;
+        if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+           file.write(QJsonDocument(json).toJson()) < 0){
+            std::cerr << "could not write " << file.fileName().toStdString() << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << scene.models.size() << " models (" << sharedObjModelAssetCount() << " distinct files) loaded in "
+              << loadTime << " ms, "
+              << width << "x" << height << " rendered in " << renderTime << " ms on "
+              << taskWorkerCount() << " threads" << std::endl;
+    std::cout << stats.primaryRays << " primary, " << stats.secondaryRays << " secondary, "
+              << stats.shadowRays << " shadow rays, " << stats.aabbTests << " box tests, "
+              << stats.triangleTests << " triangle tests, " << stats.nodesVisited
+              << " BVH nodes visited" << std::endl;
+    return 0;
+}
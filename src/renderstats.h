@@ -0,0 +1,108 @@
+#ifndef RENDERSTATS_H
+#define RENDERSTATS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <QJsonObject>
+
+// Work done by a render. Every thread counts into its own copy
+// (threadRenderStats()), so the hot paths never share a cache line; a render
+// worker takes the difference over its run and the render adds up the
+// workers' results once they are all done.
+// There is no constructor so that the per thread copy needs no guard on
+// access, use RenderStats() to get a zeroed one.
+struct RenderStats
+{
+    // camera rays, reflection and transmission rays, shadow rays
+    uint64_t primaryRays;
+    uint64_t secondaryRays;
+    uint64_t shadowRays;
+    // bounding boxes, triangles and BVH nodes (interior and leaf) of every level
+    uint64_t aabbTests;
+    uint64_t triangleTests;
+    uint64_t nodesVisited;
+    // rendered tiles and their render times, in ns
+    uint64_t tiles;
+    uint64_t tileTime;
+    uint64_t maxTileTime;
+    // wall clock time of the render, in ns
+    uint64_t renderTime;
+
+    uint64_t rays() const { return primaryRays + secondaryRays + shadowRays; }
+
+    RenderStats& operator +=(const RenderStats& other)
+    {
+        primaryRays += other.primaryRays;
+        secondaryRays += other.secondaryRays;
+        shadowRays += other.shadowRays;
+        aabbTests += other.aabbTests;
+        triangleTests += other.triangleTests;
+        nodesVisited += other.nodesVisited;
+        tiles += other.tiles;
+        tileTime += other.tileTime;
+        maxTileTime = std::max(maxTileTime, other.maxTileTime);
+        renderTime += other.renderTime;
+        return *this;
+    }
+
+    // counters only, for the difference of a thread's counters over a time span
+    RenderStats operator -(const RenderStats& other) const
+    {
+        RenderStats result = RenderStats();
+        result.primaryRays = primaryRays - other.primaryRays;
+        result.secondaryRays = secondaryRays - other.secondaryRays;
+        result.shadowRays = shadowRays - other.shadowRays;
+        result.aabbTests = aabbTests - other.aabbTests;
+        result.triangleTests = triangleTests - other.triangleTests;
+        result.nodesVisited = nodesVisited - other.nodesVisited;
+        return result;
+    }
+
+    QJsonObject toJson() const
+    {
+        QJsonObject json;
+        json["primary_rays"] = double(primaryRays);
+        json["secondary_rays"] = double(secondaryRays);
+        json["shadow_rays"] = double(shadowRays);
+        json["aabb_tests"] = double(aabbTests);
+        json["triangle_tests"] = double(triangleTests);
+        json["bvh_nodes_visited"] = double(nodesVisited);
+        json["tiles"] = double(tiles);
+        json["tile_time_ms"] = tileTime * 1e-6;
+        json["mean_tile_time_ms"] = tiles > 0 ? tileTime * 1e-6 / tiles : 0.0;
+        json["max_tile_time_ms"] = maxTileTime * 1e-6;
+        json["render_time_ms"] = renderTime * 1e-6;
+        json["rays_per_second"] = renderTime > 0 ? rays() * 1e9 / renderTime : 0.0;
+        return json;
+    }
+};
+
+// the counters of the calling thread
+inline RenderStats& threadRenderStats()
+{
+    // zeroed like any other static
+    static thread_local RenderStats stats;
+    return stats;
+}
+
+// The work of one scene query, gathered on the stack by the traversals and
+// leaf tests it runs and added to the thread's counters once at the end:
+// thread locals cost more than a register on some platforms.
+struct TraversalCounts
+{
+    unsigned int nodesVisited;
+    unsigned int aabbTests;
+    unsigned int triangleTests;
+
+    TraversalCounts() : nodesVisited(0), aabbTests(0), triangleTests(0) { }
+};
+
+inline void countTraversal(const TraversalCounts& counts)
+{
+    RenderStats& stats = threadRenderStats();
+    stats.nodesVisited += counts.nodesVisited;
+    stats.aabbTests += counts.aabbTests;
+    stats.triangleTests += counts.triangleTests;
+}
+
+#endif // RENDERSTATS_H
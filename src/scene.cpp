@@ -8,15 +8,20 @@
 #include <QDir>
 #include "objmodel.h"
 #include "light.h"
+#include "tasksystem.h"
+#include "renderstats.h"
 
-Scene::Scene()
+// a refitted top level is rebuilt once its SAH cost exceeds this multiple of
+// the cost it had when built
+const float kTopLevelRebuildRatio = 1.5f;
+
+Scene::Scene() : topLevelBuildCost(0.0f)
 {
 
 }
 
-Scene::Scene(const char* sceneFile, QOpenGLFunctions_3_3_Core *pCore){
+Scene::Scene(const char* sceneFile) : topLevelBuildCost(0.0f){
     this->sceneFile = QString(sceneFile);
-    this->pCore = pCore;
 }
 
 void Scene::loadScene()
@@ -54,12 +59,7 @@ void Scene::loadScene()
         lightFlag.push_back(true);
     }
     // models
-    QJsonArray modelArray = rootObj["models"].toArray();
-    foreach(QJsonValue value, modelArray){
-        QJsonObject modelObj = value.toObject();
-        Model* model = loadModel(modelObj);
-        models.push_back(model);
-    }
+    loadModelArray(rootObj["models"].toArray());
 }
 
 void Scene::loadModels()
@@ -79,12 +79,7 @@ void Scene::loadModels()
     }
     QJsonObject rootObj = jsonDoc.object();
     // models
-    QJsonArray modelArray = rootObj["models"].toArray();
-    foreach(QJsonValue value, modelArray){
-        QJsonObject modelObj = value.toObject();
-        Model* model = loadModel(modelObj);
-        models.push_back(model);
-    }
+    loadModelArray(rootObj["models"].toArray());
 }
 
 void Scene::loadSceneExceptModels()
@@ -199,8 +194,8 @@ Model* Scene::loadModel(QJsonObject obj){
     int type = obj["type"].toInt();
     if(type == Model::OBJMODEL){
         string objPath = obj["path"].toString().toStdString();
-        ObjModel* model = new ObjModel(objPath, false, *pCore);
-        model->modelMatrix = loadQMatrix4x4(obj["modelMatrix"].toArray());
+        ObjModel* model = new ObjModel(objPath, false);
+        model->setModelMatrix(loadQMatrix4x4(obj["modelMatrix"].toArray()));
         model->ka = loadQVector3D(obj["ka"].toObject());
         model->ks = loadQVector3D(obj["ks"].toObject());
         model->kt = loadQVector3D(obj["kt"].toObject());
@@ -209,6 +204,21 @@ Model* Scene::loadModel(QJsonObject obj){
     }
 }
 
+void Scene::loadModelArray(QJsonArray modelArray)
+{
+    // models only hold CPU data until they are drawn, so they can be
+    // imported on the pool; every one keeps its place in the array
+    std::vector<QJsonObject> modelObjs;
+    foreach(QJsonValue value, modelArray){
+        modelObjs.push_back(value.toObject());
+    }
+    size_t first = models.size();
+    models.resize(first + modelObjs.size());
+    parallelFor(modelObjs.size(), [&](size_t i){
+        models[first + i] = loadModel(modelObjs[i]);
+    });
+}
+
 QJsonObject Scene::saveModel(Model *model)
 {
     QJsonObject obj;
@@ -217,7 +227,7 @@ QJsonObject Scene::saveModel(Model *model)
         ObjModel *p = (ObjModel*)model;
         obj.insert("path", QString::fromStdString(p->path));
     }
-    obj.insert("modelMatrix", saveQMatrix4x4(model->modelMatrix));
+    obj.insert("modelMatrix", saveQMatrix4x4(model->modelMatrix()));
     obj.insert("ka", saveQVector3D(model->ka));
     obj.insert("ks", saveQVector3D(model->ks));
     obj.insert("kt", saveQVector3D(model->kt));
@@ -323,13 +333,97 @@ void Scene::saveObjScene(QString sceneFile, std::string path, QMatrix4x4 modelMa
     file.close();
 }
 
-bool Scene::intersect(Intersection &intersection)
+void Scene::updateTopLevel()
 {
     size_t size = models.size();
+    bool rebuild = topLevelModels != models;
+    bool moved = false;
+    if(rebuild)
+        topLevelBounds.resize(size);
     for(size_t i = 0; i < size; i++){
-        if(models[i]->intersect(intersection)){
-            intersection.intersected = true;
+        if(!rebuild && !models[i]->transformDirty)
+            continue;
+        topLevelBounds[i] = models[i]->aabb;
+        topLevelBounds[i].transform(models[i]->modelMatrix());
+        models[i]->transformDirty = false;
+        moved = true;
+    }
+    if(!rebuild && !moved)
+        return;
+
+    if(!rebuild){
+        // moving models only changes boxes, refitting keeps the tree valid
+        // but lets siblings drift apart; once its cost has grown too much a
+        // new tree pays for itself
+        topLevel.refit(topLevelBounds);
+        rebuild = topLevel.sahCost() > kTopLevelRebuildRatio * topLevelBuildCost;
+    }
+    if(rebuild){
+        topLevel.build(topLevelBounds);
+        topLevelBuildCost = topLevel.sahCost();
+        topLevelModels = models;
+    }
+}
+
+bool Scene::intersect(const Ray &ray, Intersection &intersection)
+{
+    // the work of the whole query goes to the thread's counters at once
+    TraversalCounts counts;
+    size_t size = models.size();
+    bool hit = false;
+    if(topLevelModels.size() != size){
+        // top level not built yet
+        for(size_t i = 0; i < size; i++){
+            if(models[i]->intersect(ray, intersection, counts))
+                hit = true;
         }
+        counts.aabbTests += static_cast<unsigned int>(size);
+        countTraversal(counts);
+        return hit;
     }
-    return intersection.intersected;
+    float tClosest = intersection.m_t;
+    // every model visited tests its bounding box first
+    unsigned int modelTests = 0;
+    hit = topLevel.intersect(ray, tClosest, [&](const BVHNode& leaf, float& tMax){
+        bool leafHit = false;
+        modelTests += leaf.count;
+        for(unsigned int i = leaf.start; i < leaf.start + leaf.count; i++){
+            if(models[topLevel.primIndices[i]]->intersect(ray, intersection, counts))
+                leafHit = true;
+        }
+        tMax = intersection.m_t;
+        return leafHit;
+    }, counts);
+    counts.aabbTests += modelTests;
+    countTraversal(counts);
+    return hit;
+}
+
+bool Scene::occluded(const Ray &ray, float tMax)
+{
+    TraversalCounts counts;
+    size_t size = models.size();
+    unsigned int modelTests = 0;
+    if(topLevelModels.size() != size){
+        // top level not built yet
+        bool blocked = false;
+        for(size_t i = 0; i < size && !blocked; i++){
+            modelTests++;
+            blocked = models[i]->occluded(ray, tMax, counts);
+        }
+        counts.aabbTests += modelTests;
+        countTraversal(counts);
+        return blocked;
+    }
+    bool blocked = topLevel.occluded(ray, tMax, [&](const BVHNode& leaf){
+        for(unsigned int i = leaf.start; i < leaf.start + leaf.count; i++){
+            modelTests++;
+            if(models[topLevel.primIndices[i]]->occluded(ray, tMax, counts))
+                return true;
+        }
+        return false;
+    }, counts);
+    counts.aabbTests += modelTests;
+    countTraversal(counts);
+    return blocked;
 }
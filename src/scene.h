@@ -5,17 +5,18 @@
 #include <QString>
 #include <QVector3D>
 #include <QMatrix4x4>
-#include <QOpenGLFunctions_3_3_Core>
+#include <QJsonObject>
+#include <QJsonArray>
+#include "bvh.h"
 
 class Model;
 class Light;
-class Intersection;
+struct Intersection;
 
 class Scene
 {
 public:
     QString sceneFile;
-    QOpenGLFunctions_3_3_Core *pCore;
 
     // Default camera parameters
     float camera_yaw;
@@ -38,9 +39,17 @@ public:
     // models
     std::vector<Model*> models;
 
+    // top level acceleration structure over the world space bounds of the models
+    BVH topLevel;
+    // the models and their world space bounds the top level was last updated for
+    std::vector<Model*> topLevelModels;
+    std::vector<AABB> topLevelBounds;
+    // SAH cost of the top level right after its last build
+    float topLevelBuildCost;
+
 public:
     Scene();
-    Scene(const char* sceneFile, QOpenGLFunctions_3_3_Core *pCore);
+    explicit Scene(const char* sceneFile);
 
     QVector3D loadQVector3D(QJsonObject obj);
     QJsonObject saveQVector3D(QVector3D v);
@@ -49,6 +58,8 @@ public:
     Light* loadLight(QJsonObject obj);
     QJsonObject saveLight(Light* light);
     Model* loadModel(QJsonObject obj);
+    // imports the models of the array in parallel, in the order of the array
+    void loadModelArray(QJsonArray modelArray);
     QJsonObject saveModel(Model* model);
     QJsonObject saveObjModel(std::string, QMatrix4x4, QVector3D, QVector3D, QVector3D, double);
     void loadScene();
@@ -57,7 +68,14 @@ public:
     void saveScene(QString sceneFile);
     void saveObjScene(QString sceneFile, std::string, QMatrix4x4, QVector3D, QVector3D, QVector3D, double);
 
-    bool intersect(Intersection& intersection);
+    // Brings the top level BVH up to date: rebuilds it when models were
+    // added or removed, refits it to the models whose transform changed
+    // otherwise, and rebuilds it anyway once refitting has made it too slow
+    void updateTopLevel();
+    // closest hit of the ray within [kRayTMin, intersection.m_t)
+    bool intersect(const Ray& ray, Intersection& intersection);
+    // true if any model blocks the ray within [kRayTMin, tMax)
+    bool occluded(const Ray& ray, float tMax);
 };
 
 #endif // SCENE_H
@@ -531,6 +531,28 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 #define STBI_EXTERN extern
 #endif
 
+// backported from stb_image 2.26: the failure reason is per thread, so that
+// images can be decoded on several threads at once
+#ifndef STBI_NO_THREAD_LOCALS
+   #ifndef STBI_THREAD_LOCAL
+      #if defined(__cplusplus) &&  __cplusplus >= 201103L
+         #define STBI_THREAD_LOCAL       thread_local
+      #elif defined(__GNUC__) && __GNUC__ < 5
+         #define STBI_THREAD_LOCAL       __thread
+      #elif defined(_MSC_VER)
+         #define STBI_THREAD_LOCAL       __declspec(thread)
+      #elif defined (__STDC_VERSION__) && __STDC_VERSION__ >= 201112L && !defined(__STDC_NO_THREADS__)
+         #define STBI_THREAD_LOCAL       _Thread_local
+      #endif
+
+      #ifndef STBI_THREAD_LOCAL
+         #if defined(__GNUC__)
+            #define STBI_THREAD_LOCAL       __thread
+         #endif
+      #endif
+   #endif
+#endif
+
 
 #ifndef _MSC_VER
    #ifdef __cplusplus
@@ -852,8 +874,12 @@ static void    *stbi__pnm_load(stbi__context *s, int *x, int *y, int *comp, int
 static int      stbi__pnm_info(stbi__context *s, int *x, int *y, int *comp);
 #endif
 
+#ifdef STBI_THREAD_LOCAL
+static STBI_THREAD_LOCAL const char *stbi__g_failure_reason;
+#else
 // this is not threadsafe
 static const char *stbi__g_failure_reason;
+#endif
 
 STBIDEF const char *stbi_failure_reason(void)
 {
@@ -0,0 +1,76 @@
+#include "tasksystem.h"
+
+#include <algorithm>
+#include <atomic>
+
+QThreadPool* taskPool()
+{
+    static QThreadPool* pool = []{
+        QThreadPool* globalPool = QThreadPool::globalInstance();
+        // idle threads would otherwise exit after 30 seconds
+        globalPool->setExpiryTimeout(-1);
+        return globalPool;
+    }();
+    return pool;
+}
+
+int taskWorkerCount()
+{
+    return std::max(taskPool()->maxThreadCount(), 1);
+}
+
+TaskGroup::TaskGroup(TaskPriority priority)
+    : m_priority(priority)
+{
+
+}
+
+TaskGroup::~TaskGroup()
+{
+    wait();
+}
+
+void TaskGroup::run(const std::function<void()> &func)
+{
+    Task* task = new Task(func, m_finished);
+    m_tasks.push_back(task);
+    taskPool()->start(task, m_priority);
+}
+
+void TaskGroup::wait()
+{
+    if(m_tasks.empty())
+        return;
+    // help with the tasks that are still queued, newest first since those
+    // are the least likely to be picked up soon
+    for(size_t i = m_tasks.size(); i > 0; i--){
+        if(taskPool()->tryTake(m_tasks[i - 1]))
+            m_tasks[i - 1]->run();
+    }
+    m_finished.acquire(static_cast<int>(m_tasks.size()));
+    for(size_t i = 0; i < m_tasks.size(); i++)
+        delete m_tasks[i];
+    m_tasks.clear();
+}
+
+void parallelFor(size_t count, const std::function<void(size_t)> &body, TaskPriority priority)
+{
+    if(count == 0)
+        return;
+    if(count == 1){
+        body(0);
+        return;
+    }
+    // one task per worker, the tasks take the next index until none is left
+    // so that a few expensive items do not hold up a fixed share
+    size_t taskNum = std::min(count, static_cast<size_t>(taskWorkerCount()));
+    std::atomic<size_t> next(0);
+    TaskGroup group(priority);
+    for(size_t t = 0; t < taskNum; t++){
+        group.run([&body, &next, count]{
+            for(size_t i = next++; i < count; i = next++)
+                body(i);
+        });
+    }
+    group.wait();
+}
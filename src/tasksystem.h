@@ -0,0 +1,58 @@
+#ifndef TASKSYSTEM_H
+#define TASKSYSTEM_H
+
+#include <functional>
+#include <vector>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QSemaphore>
+
+// Rendering, BVH construction, texture decoding and model import all run on
+// one long-lived pool (QThreadPool::globalInstance()) so that they share the
+// cores and never pay for starting threads. Higher priorities start first.
+enum TaskPriority {LowPriority, NormalPriority, HighPriority};
+
+// the shared pool, its threads are kept alive between uses
+QThreadPool* taskPool();
+// number of tasks that can run at the same time
+int taskWorkerCount();
+
+// A set of tasks started on the shared pool; wait() blocks until all of
+// them have finished. While waiting, tasks of the group that no pool thread
+// has picked up yet are run by the waiting thread itself, so groups can be
+// nested inside pool tasks without starving the pool.
+class TaskGroup
+{
+public:
+    explicit TaskGroup(TaskPriority priority = NormalPriority);
+    ~TaskGroup();
+
+    void run(const std::function<void()>& func);
+    void wait();
+
+private:
+    class Task : public QRunnable
+    {
+    public:
+        Task(const std::function<void()>& func, QSemaphore& finished)
+            : m_func(func), m_finished(finished) { setAutoDelete(false); }
+        void run() { m_func(); m_finished.release(); }
+
+    private:
+        std::function<void()> m_func;
+        QSemaphore& m_finished;
+    };
+
+    TaskPriority m_priority;
+    std::vector<Task*> m_tasks;
+    QSemaphore m_finished;
+
+    TaskGroup(const TaskGroup&);
+    TaskGroup& operator =(const TaskGroup&);
+};
+
+// runs body(i) for every i in [0, count) on the shared pool and waits for it
+void parallelFor(size_t count, const std::function<void(size_t)>& body,
+                 TaskPriority priority = NormalPriority);
+
+#endif // TASKSYSTEM_H
@@ -0,0 +1,98 @@
+#include "tilescheduler.h"
+
+static uint64_t packRange(uint32_t begin, uint32_t end)
+{
+    return (static_cast<uint64_t>(begin) << 32) | end;
+}
+
+static uint32_t rangeBegin(uint64_t range) { return static_cast<uint32_t>(range >> 32); }
+static uint32_t rangeEnd(uint64_t range) { return static_cast<uint32_t>(range); }
+
+TileScheduler::TileScheduler(size_t width, size_t height, size_t tileSize, unsigned int workerNum)
+    : m_width(width), m_height(height), m_tileSize(tileSize),
+      m_ranges(workerNum > 0 ? workerNum : 1)
+{
+    m_xTiles = (width + tileSize - 1) / tileSize;
+    size_t yTiles = (height + tileSize - 1) / tileSize;
+    m_tileNum = static_cast<unsigned int>(m_xTiles * yTiles);
+
+    // start every worker with an equal share of consecutive tiles
+    size_t workers = m_ranges.size();
+    for(size_t i = 0; i < workers; i++){
+        uint32_t begin = static_cast<uint32_t>(m_tileNum * i / workers);
+        uint32_t end = static_cast<uint32_t>(m_tileNum * (i + 1) / workers);
+        m_ranges[i].range.store(packRange(begin, end), std::memory_order_relaxed);
+    }
+}
+
+bool TileScheduler::nextTile(unsigned int worker, Tile &tile)
+{
+    unsigned int tileIndex;
+    while(!popFront(worker, tileIndex)){
+        if(!steal(worker))
+            return false;
+    }
+    tile = tileAt(tileIndex);
+    return true;
+}
+
+bool TileScheduler::popFront(unsigned int worker, unsigned int &tileIndex)
+{
+    std::atomic<uint64_t>& slot = m_ranges[worker].range;
+    uint64_t range = slot.load(std::memory_order_acquire);
+    // thieves may shrink the range at the same time, retry until one side wins
+    while(rangeBegin(range) < rangeEnd(range)){
+        uint64_t popped = packRange(rangeBegin(range) + 1, rangeEnd(range));
+        if(slot.compare_exchange_weak(range, popped, std::memory_order_acq_rel)){
+            tileIndex = rangeBegin(range);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TileScheduler::steal(unsigned int thief)
+{
+    size_t workers = m_ranges.size();
+    for(;;){
+        // the victim is the worker with the most tiles left
+        size_t victim = workers;
+        uint64_t victimRange = 0;
+        uint32_t most = 0;
+        for(size_t i = 0; i < workers; i++){
+            if(i == thief)
+                continue;
+            uint64_t range = m_ranges[i].range.load(std::memory_order_acquire);
+            uint32_t left = rangeEnd(range) - rangeBegin(range);
+            if(rangeBegin(range) < rangeEnd(range) && left > most){
+                victim = i;
+                victimRange = range;
+                most = left;
+            }
+        }
+        if(victim == workers)
+            return false;
+
+        // the victim keeps the front half, a single tile is taken whole
+        uint32_t begin = rangeBegin(victimRange);
+        uint32_t end = rangeEnd(victimRange);
+        uint32_t mid = begin + (end - begin) / 2;
+        if(m_ranges[victim].range.compare_exchange_strong(victimRange, packRange(begin, mid),
+                                                          std::memory_order_acq_rel)){
+            // only the owner refills its own empty range, so a plain store is enough
+            m_ranges[thief].range.store(packRange(mid, end), std::memory_order_release);
+            return true;
+        }
+        // lost the race against the victim or another thief, look again
+    }
+}
+
+Tile TileScheduler::tileAt(unsigned int tileIndex) const
+{
+    Tile tile;
+    tile.xstart = (tileIndex % m_xTiles) * m_tileSize;
+    tile.ystart = (tileIndex / m_xTiles) * m_tileSize;
+    tile.xend = tile.xstart + m_tileSize < m_width ? tile.xstart + m_tileSize : m_width;
+    tile.yend = tile.ystart + m_tileSize < m_height ? tile.ystart + m_tileSize : m_height;
+    return tile;
+}
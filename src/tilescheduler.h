@@ -0,0 +1,50 @@
+#ifndef TILESCHEDULER_H
+#define TILESCHEDULER_H
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+const size_t kTileSize = 32;
+
+struct Tile
+{
+    size_t xstart, xend, ystart, yend;
+};
+
+// Hands out the tiles of an image to a fixed number of workers without locks.
+// Every worker owns a contiguous range of tile indices and takes tiles from
+// its front; a worker that runs dry steals the back half of the largest
+// remaining range, so slow tiles do not leave the other workers idle.
+class TileScheduler
+{
+public:
+    TileScheduler(size_t width, size_t height, size_t tileSize, unsigned int workerNum);
+
+    unsigned int tileCount() const { return m_tileNum; }
+    unsigned int workerCount() const { return static_cast<unsigned int>(m_ranges.size()); }
+
+    // next tile for the worker, false once every tile has been handed out
+    bool nextTile(unsigned int worker, Tile& tile);
+
+private:
+    // tile range [begin, end) packed as begin << 32 | end so that both ends
+    // change with a single compare and swap; padded to a cache line
+    struct WorkerRange
+    {
+        std::atomic<uint64_t> range;
+        char padding[64 - sizeof(std::atomic<uint64_t>)];
+    };
+
+    size_t m_width, m_height, m_tileSize;
+    size_t m_xTiles;
+    unsigned int m_tileNum;
+    std::vector<WorkerRange> m_ranges;
+
+    bool popFront(unsigned int worker, unsigned int& tileIndex);
+    bool steal(unsigned int thief);
+    Tile tileAt(unsigned int tileIndex) const;
+};
+
+#endif // TILESCHEDULER_H
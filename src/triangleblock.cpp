@@ -0,0 +1,318 @@
+#include "triangleblock.h"
+
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    #define TRIANGLEBLOCK_X86
+    #include <immintrin.h>
+#endif
+
+// the AVX2 kernel needs per-function target attributes and __builtin_cpu_supports
+#if defined(TRIANGLEBLOCK_X86) && defined(__GNUC__)
+    #define TRIANGLEBLOCK_AVX2
+#endif
+
+TriangleBlock::TriangleBlock()
+{
+    for(unsigned int i = 0; i < kTriangleBlockWidth; i++){
+        v0x[i] = v0y[i] = v0z[i] = 0.0f;
+        e1x[i] = e1y[i] = e1z[i] = 0.0f;
+        e2x[i] = e2y[i] = e2z[i] = 0.0f;
+        primIndex[i] = 0;
+    }
+}
+
+void TriangleBlock::setTriangle(unsigned int lane, const Point &p0, const Point &p1, const Point &p2,
+                                unsigned int prim)
+{
+    v0x[lane] = p0.m_x;
+    v0y[lane] = p0.m_y;
+    v0z[lane] = p0.m_z;
+    e1x[lane] = p1.m_x - p0.m_x;
+    e1y[lane] = p1.m_y - p0.m_y;
+    e1z[lane] = p1.m_z - p0.m_z;
+    e2x[lane] = p2.m_x - p0.m_x;
+    e2y[lane] = p2.m_y - p0.m_y;
+    e2z[lane] = p2.m_z - p0.m_z;
+    primIndex[lane] = prim;
+}
+
+// The kernels are instantiated twice: closest hit, and any hit for occlusion
+// queries, which returns on the first triangle found within tMax.
+
+// the reference and fallback, also built on x86 so the SIMD kernels can be
+// compared against it
+template<bool kAnyHit>
+static bool intersectBlocksScalar(const TriangleBlock* blocks, unsigned int count,
+                                  const Ray& ray, float tMax, TriangleHit& hit)
+{
+    bool found = false;
+    const Vector& d = ray.m_direction;
+    for(unsigned int b = 0; b < count; b++){
+        const TriangleBlock& block = blocks[b];
+        for(unsigned int i = 0; i < kTriangleBlockWidth; i++){
+            Vector e1(block.e1x[i], block.e1y[i], block.e1z[i]);
+            Vector e2(block.e2x[i], block.e2y[i], block.e2z[i]);
+            Vector pvec = cross(d, e2);
+            float det = dot(e1, pvec);
+            if(det == 0.0f)
+                continue;
+            float invDet = 1.0f / det;
+            Vector tvec = ray.m_origin - Point(block.v0x[i], block.v0y[i], block.v0z[i]);
+            float u = dot(tvec, pvec) * invDet;
+            if(u < 0.0f || u > 1.0f)
+                continue;
+            Vector qvec = cross(tvec, e1);
+            float v = dot(d, qvec) * invDet;
+            if(v < 0.0f || u + v > 1.0f)
+                continue;
+            float t = dot(e2, qvec) * invDet;
+            if(t < kRayTMin || t >= tMax)
+                continue;
+            if(kAnyHit)
+                return true;
+            tMax = t;
+            hit.t = t;
+            hit.u = u;
+            hit.v = v;
+            hit.primIndex = block.primIndex[i];
+            found = true;
+        }
+    }
+    return found;
+}
+
+#ifdef TRIANGLEBLOCK_X86
+// 4 lanes at a time, a block is done in two halves
+template<bool kAnyHit>
+static bool intersectBlocksSSE(const TriangleBlock* blocks, unsigned int count,
+                               const Ray& ray, float tMax, TriangleHit& hit)
+{
+    const __m128 dx = _mm_set1_ps(ray.m_direction.m_x);
+    const __m128 dy = _mm_set1_ps(ray.m_direction.m_y);
+    const __m128 dz = _mm_set1_ps(ray.m_direction.m_z);
+    const __m128 ox = _mm_set1_ps(ray.m_origin.m_x);
+    const __m128 oy = _mm_set1_ps(ray.m_origin.m_y);
+    const __m128 oz = _mm_set1_ps(ray.m_origin.m_z);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 tMin = _mm_set1_ps(kRayTMin);
+    __m128 tMaxV = _mm_set1_ps(tMax);
+
+    bool found = false;
+    for(unsigned int b = 0; b < count; b++){
+        const TriangleBlock& block = blocks[b];
+        for(unsigned int h = 0; h < kTriangleBlockWidth; h += 4){
+            __m128 e1x = _mm_loadu_ps(block.e1x + h);
+            __m128 e1y = _mm_loadu_ps(block.e1y + h);
+            __m128 e1z = _mm_loadu_ps(block.e1z + h);
+            __m128 e2x = _mm_loadu_ps(block.e2x + h);
+            __m128 e2y = _mm_loadu_ps(block.e2y + h);
+            __m128 e2z = _mm_loadu_ps(block.e2z + h);
+            // pvec = d x e2
+            __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+            __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+            __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+            __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+            __m128 invDet = _mm_div_ps(one, det);
+            // tvec = o - v0
+            __m128 tx = _mm_sub_ps(ox, _mm_loadu_ps(block.v0x + h));
+            __m128 ty = _mm_sub_ps(oy, _mm_loadu_ps(block.v0y + h));
+            __m128 tz = _mm_sub_ps(oz, _mm_loadu_ps(block.v0z + h));
+            __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), invDet);
+            // qvec = tvec x e1
+            __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+            __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+            __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+            __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+            __m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+            // degenerate lanes produce NaN and fail the ordered compares
+            __m128 mask = _mm_and_ps(_mm_cmpneq_ps(det, zero), _mm_cmpge_ps(u, zero));
+            mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+            mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+            mask = _mm_and_ps(mask, _mm_cmpge_ps(t, tMin));
+            mask = _mm_and_ps(mask, _mm_cmplt_ps(t, tMaxV));
+            int bits = _mm_movemask_ps(mask);
+            if(bits == 0)
+                continue;
+            if(kAnyHit)
+                return true;
+            float ts[4], us[4], vs[4];
+            _mm_storeu_ps(ts, t);
+            _mm_storeu_ps(us, u);
+            _mm_storeu_ps(vs, v);
+            for(int i = 0; i < 4; i++){
+                if((bits & (1 << i)) && ts[i] < tMax){
+                    tMax = ts[i];
+                    hit.t = ts[i];
+                    hit.u = us[i];
+                    hit.v = vs[i];
+                    hit.primIndex = block.primIndex[h + i];
+                    found = true;
+                }
+            }
+            tMaxV = _mm_set1_ps(tMax);
+        }
+    }
+    return found;
+}
+#endif
+
+#ifdef TRIANGLEBLOCK_AVX2
+// a whole block per iteration
+template<bool kAnyHit>
+__attribute__((target("avx2")))
+static bool intersectBlocksAVX2(const TriangleBlock* blocks, unsigned int count,
+                                const Ray& ray, float tMax, TriangleHit& hit)
+{
+    const __m256 dx = _mm256_set1_ps(ray.m_direction.m_x);
+    const __m256 dy = _mm256_set1_ps(ray.m_direction.m_y);
+    const __m256 dz = _mm256_set1_ps(ray.m_direction.m_z);
+    const __m256 ox = _mm256_set1_ps(ray.m_origin.m_x);
+    const __m256 oy = _mm256_set1_ps(ray.m_origin.m_y);
+    const __m256 oz = _mm256_set1_ps(ray.m_origin.m_z);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 tMin = _mm256_set1_ps(kRayTMin);
+    __m256 tMaxV = _mm256_set1_ps(tMax);
+
+    bool found = false;
+    for(unsigned int b = 0; b < count; b++){
+        const TriangleBlock& block = blocks[b];
+        __m256 e1x = _mm256_loadu_ps(block.e1x);
+        __m256 e1y = _mm256_loadu_ps(block.e1y);
+        __m256 e1z = _mm256_loadu_ps(block.e1z);
+        __m256 e2x = _mm256_loadu_ps(block.e2x);
+        __m256 e2y = _mm256_loadu_ps(block.e2y);
+        __m256 e2z = _mm256_loadu_ps(block.e2z);
+        // pvec = d x e2
+        __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+        __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+        __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+        __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+        __m256 invDet = _mm256_div_ps(one, det);
+        // tvec = o - v0
+        __m256 tx = _mm256_sub_ps(ox, _mm256_loadu_ps(block.v0x));
+        __m256 ty = _mm256_sub_ps(oy, _mm256_loadu_ps(block.v0y));
+        __m256 tz = _mm256_sub_ps(oz, _mm256_loadu_ps(block.v0z));
+        __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), invDet);
+        // qvec = tvec x e1
+        __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+        __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+        __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+        __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), invDet);
+        __m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), invDet);
+        // degenerate lanes produce NaN and fail the ordered compares
+        __m256 mask = _mm256_and_ps(_mm256_cmp_ps(det, zero, _CMP_NEQ_UQ), _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, tMin, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, tMaxV, _CMP_LT_OQ));
+        int bits = _mm256_movemask_ps(mask);
+        if(bits == 0)
+            continue;
+        if(kAnyHit)
+            return true;
+        float ts[8], us[8], vs[8];
+        _mm256_storeu_ps(ts, t);
+        _mm256_storeu_ps(us, u);
+        _mm256_storeu_ps(vs, v);
+        for(int i = 0; i < 8; i++){
+            if((bits & (1 << i)) && ts[i] < tMax){
+                tMax = ts[i];
+                hit.t = ts[i];
+                hit.u = us[i];
+                hit.v = vs[i];
+                hit.primIndex = block.primIndex[i];
+                found = true;
+            }
+        }
+        tMaxV = _mm256_set1_ps(tMax);
+    }
+    return found;
+}
+#endif
+
+typedef bool (*TriangleKernelFunction)(const TriangleBlock*, unsigned int, const Ray&, float, TriangleHit&);
+
+struct TriangleKernelInfo
+{
+    TriangleKernelFunction kernel;
+    TriangleKernelFunction anyHitKernel;
+    const char* name;
+};
+
+// indexed by TriangleKernel, kernels left out of this build have no functions
+static const TriangleKernelInfo s_triangleKernels[] = {
+    {intersectBlocksScalar<false>, intersectBlocksScalar<true>, "scalar"},
+#ifdef TRIANGLEBLOCK_X86
+    {intersectBlocksSSE<false>, intersectBlocksSSE<true>, "sse"},
+#else
+    {nullptr, nullptr, "sse"},
+#endif
+#ifdef TRIANGLEBLOCK_AVX2
+    {intersectBlocksAVX2<false>, intersectBlocksAVX2<true>, "avx2"},
+#else
+    {nullptr, nullptr, "avx2"},
+#endif
+};
+
+static bool triangleKernelSupported(TriangleKernel kernel)
+{
+    if(!s_triangleKernels[kernel].kernel)
+        return false;
+#ifdef TRIANGLEBLOCK_AVX2
+    if(kernel == AVX2Kernel){
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return true;
+}
+
+static TriangleKernel widestTriangleKernel()
+{
+    if(triangleKernelSupported(AVX2Kernel))
+        return AVX2Kernel;
+    if(triangleKernelSupported(SSEKernel))
+        return SSEKernel;
+    return ScalarKernel;
+}
+
+static std::atomic<int> s_triangleKernel(widestTriangleKernel());
+
+bool setTriangleKernel(TriangleKernel kernel)
+{
+    if(!triangleKernelSupported(kernel))
+        return false;
+    s_triangleKernel = kernel;
+    return true;
+}
+
+TriangleKernel triangleKernel()
+{
+    return static_cast<TriangleKernel>(s_triangleKernel.load());
+}
+
+const char* triangleKernelName(TriangleKernel kernel)
+{
+    return s_triangleKernels[kernel].name;
+}
+
+bool intersectTriangleBlocks(const TriangleBlock *blocks, unsigned int count,
+                             const Ray &ray, float tMax, TriangleHit &hit)
+{
+    return s_triangleKernels[s_triangleKernel.load()].kernel(blocks, count, ray, tMax, hit);
+}
+
+bool occludedTriangleBlocks(const TriangleBlock *blocks, unsigned int count,
+                            const Ray &ray, float tMax)
+{
+    TriangleHit hit;
+    return s_triangleKernels[s_triangleKernel.load()].anyHitKernel(blocks, count, ray, tMax, hit);
+}
+
+const char *triangleKernelName()
+{
+    return triangleKernelName(triangleKernel());
+}
@@ -0,0 +1,57 @@
+#ifndef TRIANGLEBLOCK_H
+#define TRIANGLEBLOCK_H
+
+#include "raytracing/basic.h"
+
+const unsigned int kTriangleBlockWidth = 8;
+
+// Triangles of a BVH leaf in structure-of-arrays layout so that one ray can be
+// tested against all of them with SIMD instructions. Each lane stores vertex 0
+// and the two edges leaving it; unused lanes hold degenerate triangles that
+// never report a hit.
+struct TriangleBlock
+{
+    float v0x[kTriangleBlockWidth], v0y[kTriangleBlockWidth], v0z[kTriangleBlockWidth];
+    float e1x[kTriangleBlockWidth], e1y[kTriangleBlockWidth], e1z[kTriangleBlockWidth];
+    float e2x[kTriangleBlockWidth], e2y[kTriangleBlockWidth], e2z[kTriangleBlockWidth];
+    unsigned int primIndex[kTriangleBlockWidth];
+
+    TriangleBlock();
+    void setTriangle(unsigned int lane, const Point& p0, const Point& p1, const Point& p2,
+                     unsigned int prim);
+};
+
+struct TriangleHit
+{
+    float t;
+    // barycentric weights of vertex 1 and vertex 2
+    float u, v;
+    unsigned int primIndex;
+};
+
+// Moller-Trumbore test of the ray against every triangle of the blocks,
+// keeps the closest hit with kRayTMin <= t < tMax. Runs the kernel set by
+// setTriangleKernel(), the widest one the CPU supports by default.
+bool intersectTriangleBlocks(const TriangleBlock* blocks, unsigned int count,
+                             const Ray& ray, float tMax, TriangleHit& hit);
+
+// true if any triangle of the blocks is hit with kRayTMin <= t < tMax,
+// returns on the first one found
+bool occludedTriangleBlocks(const TriangleBlock* blocks, unsigned int count,
+                            const Ray& ray, float tMax);
+
+// How many triangles the leaf tests check at once: one by one, four with
+// SSE or eight with AVX2
+enum TriangleKernel {ScalarKernel, SSEKernel, AVX2Kernel};
+
+// the kernel of the leaf tests from now on, e.g. to compare them in the
+// benchmark; returns false and keeps the current one if this build or CPU
+// lacks it. The scalar kernel is always there.
+bool setTriangleKernel(TriangleKernel kernel);
+TriangleKernel triangleKernel();
+// "scalar", "sse" or "avx2"
+const char* triangleKernelName(TriangleKernel kernel);
+// name of the kernel in use
+const char* triangleKernelName();
+
+#endif // TRIANGLEBLOCK_H